@@ -22,7 +22,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <new>
+#include <vector>
+#if MIRRORED_WINDOW
+#include <sys/mman.h>
+#endif
 
 #include "lzip.h"
 #include "decoder.h"
@@ -68,32 +75,423 @@ int writeblock( const int fd, const uint8_t * const buf, const int size )
   }
 
 
+void Mem_writer::write( const uint8_t * const buf, const int size )
+  {
+  if( read_pos > 0 && size_ + size > capacity )
+    {
+    size_ -= read_pos;
+    memmove( data_, data_ + read_pos, size_ );
+    read_pos = 0;
+    }
+  if( size_ + size > capacity )
+    {
+    long long new_capacity = max( 65536LL, capacity );
+    while( new_capacity < size_ + size ) new_capacity *= 2;
+    uint8_t * const tmp = (uint8_t *)realloc( data_, new_capacity );
+    if( !tmp ) throw std::bad_alloc();
+    data_ = tmp; capacity = new_capacity;
+    }
+  memcpy( data_ + size_, buf, size );
+  size_ += size;
+  }
+
+
+uint8_t * Mem_writer::reserve( const long long size )
+  {
+  if( read_pos > 0 )
+    {
+    size_ -= read_pos;
+    memmove( data_, data_ + read_pos, size_ );
+    read_pos = 0;
+    }
+  if( size < 0 ) throw Error( "Invalid size" );
+  if( size_ + size > capacity || !data_ )	// exact size; it may be large
+    {
+    const long long new_capacity = ( size_ + size > 0 ) ? size_ + size : 1;
+    uint8_t * const tmp = (uint8_t *)realloc( data_, new_capacity );
+    if( !tmp ) throw std::bad_alloc();
+    data_ = tmp; capacity = new_capacity;
+    }
+  return data_ + size_;
+  }
+
+
+bool index_members( const uint8_t * const buf, const long long size,
+                    std::vector< Member_info > & members )
+  {
+  // LZMA can't compress much more than 7000:1
+  const long long max_ratio = 8000;
+  const long long min_member_size = File_header::size + File_trailer::size() + 5;
+  members.clear();
+  if( size <= 0 ) return false;
+  long long pos = size;
+  while( pos > 0 )
+    {
+    if( pos < min_member_size ) return false;
+    File_trailer trailer;
+    memcpy( trailer.data, buf + pos - File_trailer::size(), File_trailer::size() );
+    const long long member_size = trailer.member_size();
+    const long long data_size = trailer.data_size();
+    if( member_size < min_member_size || member_size > pos ||
+        data_size < 0 || data_size > member_size * max_ratio ||
+        data_size > INT_MAX ) return false;
+    File_header header;
+    memcpy( header.data, buf + pos - member_size, File_header::size );
+    if( !header.verify_magic() || header.version() != 1 ||
+        header.dictionary_size() < min_dictionary_size ||
+        header.dictionary_size() > max_dictionary_size ) return false;
+    pos -= member_size;
+    const Member_info member = { pos, member_size, data_size };
+    members.push_back( member );
+    }
+  for( unsigned i = 0; i < members.size() / 2; ++i )	// forward order
+    {
+    const Member_info tmp = members[i];
+    members[i] = members[members.size()-1-i];
+    members[members.size()-1-i] = tmp;
+    }
+  return true;
+  }
+
+
 bool Range_decoder::read_block()
   {
   if( !at_stream_end )
     {
-    stream_pos = readblock( infd, buffer, buffer_size );
-    if( stream_pos != buffer_size && errno ) exit(-1);
-    at_stream_end = ( stream_pos < buffer_size );
+    if( mem_reader && ( infd < 0 || buffer != block ) )
+      {					// move the window, don't copy
+      mem_reader->skip( pos );
+      partial_member_pos += pos;
+      pos = 0;
+      buffer = mem_reader->ptr();
+      stream_pos = min( mem_reader->available(), (long long)max_window_size );
+      if( infd < 0 )
+        at_stream_end = ( stream_pos == mem_reader->available() );
+      else if( stream_pos < buffer_size )	// go on reading from infd
+        {
+        if( stream_pos > 0 ) memcpy( block, buffer, stream_pos );
+        mem_reader->skip( stream_pos );
+        buffer = block;
+        }
+      }
+    if( infd >= 0 && buffer == block )
+      {
+      const int rest = stream_pos - pos;	// bytes not yet decoded
+      if( rest > 0 && pos > 0 ) memmove( block, block + pos, rest );
+      partial_member_pos += pos;
+      pos = 0;
+      const int size = buffer_size - rest;
+      const int rd = readblock( infd, block + rest, size );
+      if( rd != size && errno ) throw Error( "Read error" );
+      stream_pos = rest + rd;
+      at_stream_end = ( rd < size );
+      }
+    }
+  if( at_stream_end && buffer != tail && stream_pos - pos < min_available_bytes )
+    {
+    const int rest = stream_pos - pos;
+    if( rest > 0 ) memcpy( tail, buffer + pos, rest );
     partial_member_pos += pos;
     pos = 0;
+    stream_pos = rest;
+    buffer = tail;
     }
   return pos < stream_pos;
   }
 
 
-void LZ_decoder::flush_data()
+int Range_decoder::write_data( const uint8_t * const inbuf, const int size )
+  {
+  if( at_stream_end || size <= 0 ) return 0;
+  if( pos > 0 && buffer_size - stream_pos < size )
+    {
+    const int rest = stream_pos - pos;
+    if( rest > 0 ) memmove( block, block + pos, rest );
+    partial_member_pos += pos;
+    stream_pos = rest;
+    pos = 0;
+    }
+  const int wr = min( size, buffer_size - stream_pos );
+  memcpy( block + stream_pos, inbuf, wr );
+  stream_pos += wr;
+  return wr;
+  }
+
+
+// The window starts with 'size' bytes and is grown as data is decoded,
+// up to 'max_size', so that small members don't pay for the full
+// dictionary size declared in their header.
+//
+// If MIRRORED_WINDOW is defined to 1 (Linux only), large windows are
+// instead mapped at full size twice, back to back, so that data can be
+// accessed across the wrap-around point without splitting the access.
+// Making the mapping costs some 25 us, so small windows (which lzip uses
+// for small files) get an ordinary buffer, as they do if the mapping fails.
+//
+#if MIRRORED_WINDOW
+uint8_t * LZ_decoder::new_window( int & size, const int max_size,
+                                  bool & mirrored )
+  {
+  mirrored = false;
+  const long page_size = sysconf( _SC_PAGESIZE );
+  if( max_size >= 1 << 20 && page_size > 0 && max_size % page_size == 0 )
+    {
+    const int fd = memfd_create( "lzip_window", MFD_CLOEXEC );
+    if( fd >= 0 )
+      {
+      uint8_t * p = 0;
+      void * const base = ( ftruncate( fd, max_size ) == 0 ) ?
+        mmap( 0, 2 * (size_t)max_size, PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) :
+        MAP_FAILED;
+      if( base != MAP_FAILED )
+        {
+        p = (uint8_t *)base;
+        if( mmap( p, max_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, fd, 0 ) == MAP_FAILED ||
+            mmap( p + max_size, max_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, fd, 0 ) == MAP_FAILED )
+          { munmap( base, 2 * (size_t)max_size ); p = 0; }
+        }
+      close( fd );
+      if( p ) { mirrored = true; size = max_size; return p; }
+      }
+    }
+  return new uint8_t[size];
+  }
+#else
+uint8_t * LZ_decoder::new_window( int & size, const int, bool & mirrored )
+  {
+  mirrored = false;
+  return new uint8_t[size];
+  }
+#endif
+
+
+#if MIRRORED_WINDOW
+void LZ_decoder::delete_window( uint8_t * const p, const int size,
+                                const bool mirrored )
+  {
+  if( mirrored ) { munmap( p, 2 * (size_t)size ); return; }
+  delete[] p;
+  }
+#else
+void LZ_decoder::delete_window( uint8_t * const p, const int, const bool )
+  { delete[] p; }
+#endif
+
+
+// Computes the CRC of, and writes to 'outfd' if valid, one block of data
+// at a time on its own thread. A block must not be modified until 'wait'
+// returns.
+//
+class Write_behind
+  {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;		// a block was started, or finished
+  pthread_t thread;
+  const uint8_t * block;
+  int size;			// bytes of block pending, 0 if none
+  uint32_t & crc;
+  const int outfd;
+  int error;			// errno of a failed write, or 0
+  bool quit;
+
+  Write_behind( const Write_behind & );		// declared as private
+  void operator=( const Write_behind & );	// declared as private
+
+  static void * run( void * const arg );
+
+public:
+  Write_behind( uint32_t & c, const int ofd )
+    : block( 0 ), size( 0 ), crc( c ), outfd( ofd ), error( 0 ), quit( false )
+    {
+    pthread_mutex_init( &mutex, 0 );
+    pthread_cond_init( &cond, 0 );
+    }
+
+  ~Write_behind()
+    {
+    pthread_mutex_lock( &mutex );
+    quit = true;
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &mutex );
+    pthread_join( thread, 0 );
+    pthread_cond_destroy( &cond );
+    pthread_mutex_destroy( &mutex );
+    }
+
+  bool start_thread()
+    { return pthread_create( &thread, 0, run, this ) == 0; }
+
+  void start( const uint8_t * const buf, const int sz )
+    {
+    pthread_mutex_lock( &mutex );
+    block = buf; size = sz;
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &mutex );
+    }
+
+       // Waits until the pending block, if any, is done. Throws the first
+       // write error found.
+  void wait()
+    {
+    pthread_mutex_lock( &mutex );
+    while( size > 0 ) pthread_cond_wait( &cond, &mutex );
+    const int e = error;
+    error = 0;
+    pthread_mutex_unlock( &mutex );
+    if( e ) { errno = e; throw Error( "Write error" ); }
+    }
+  };
+
+
+void * Write_behind::run( void * const arg )
+  {
+  Write_behind & wb = *(Write_behind *)arg;
+  pthread_mutex_lock( &wb.mutex );
+  while( true )
+    {
+    while( wb.size <= 0 && !wb.quit ) pthread_cond_wait( &wb.cond, &wb.mutex );
+    if( wb.size <= 0 ) break;
+    const uint8_t * const buf = wb.block;
+    const int size = wb.size;
+    const bool write = ( wb.outfd >= 0 && !wb.error );
+    pthread_mutex_unlock( &wb.mutex );
+    crc32.update( wb.crc, buf, size );
+    const bool failed = ( write && writeblock( wb.outfd, buf, size ) != size );
+    const int e = errno;
+    pthread_mutex_lock( &wb.mutex );
+    if( failed ) wb.error = e;
+    wb.size = 0;
+    pthread_cond_broadcast( &wb.cond );
+    }
+  pthread_mutex_unlock( &wb.mutex );
+  return 0;
+  }
+
+
+void LZ_decoder::grow_window()
+  {
+  const int new_size = ( buffer_size <= max_buffer_size / 2 ) ?
+                       2 * buffer_size : max_buffer_size;
+  uint8_t * const tmp = new uint8_t[new_size];
+  memcpy( tmp, buffer, buffer_size );
+  delete[] buffer;
+  buffer = tmp; buffer_size = new_size;
+  }
+
+
+// Prepares the decoder for a new member, keeping its window and the data
+// sinks given to the constructor (not valid in linear mode). A window
+// larger than the new member needs is kept as is; only a mirrored window
+// that is too small is replaced, as it can't grow.
+//
+void LZ_decoder::reset( const File_header & header )
+  {
+  if( write_behind ) write_behind->wait();
+  partial_data_pos = 0;
+  dictionary_size = header.dictionary_size();
+  max_buffer_size = max( (int)min_buffer_size, dictionary_size );
+  if( mirrored && buffer_size < max_buffer_size )
+    {
+    delete_window( buffer, buffer_size, mirrored );
+    buffer = 0; mirrored = false;
+    buffer_size = min_buffer_size;
+    buffer = new_window( buffer_size, max_buffer_size, mirrored );
+    }
+  max_buffer_size = max( max_buffer_size, buffer_size );
+  pos = 0;
+  stream_pos = 0;
+  get_pos = 0;
+  crc_ = 0xFFFFFFFFU;
+  member_version = header.version();
+  for( int i = 0; i < State::states; ++i ) state_models[i] = State_models();
+  init_models( bm_dis_slot[0], max_dis_states * ( 1 << dis_slot_bits ) );
+  init_models( bm_dis, modeled_distances - end_dis_model + 1 );
+  init_models( bm_align, dis_align_size );
+  len_decoder.init();
+  rep_match_len_decoder.init();
+  literal_decoder.init();
+  init();
+  flush_limit = next_flush_limit();
+  }
+
+
+LZ_decoder::~LZ_decoder()
+  {
+  delete write_behind;
+  if( !linear ) delete_window( buffer, buffer_size, mirrored );
+  }
+
+
+bool LZ_decoder::start_write_behind()
+  {
+  if( write_behind ) return true;
+  if( linear || mirrored || user_reads || mem_writer ) return false;
+  flush_data();
+  Write_behind * const wb = new Write_behind( crc_, outfd );
+  if( !wb->start_thread() ) { delete wb; return false; }
+  write_behind = wb;
+  flush_limit = next_flush_limit();
+  return true;
+  }
+
+
+// With write-behind, once the window has wrapped it is flushed by halves,
+// so that the decoder never writes to the half being written out.
+//
+int LZ_decoder::next_flush_limit() const
+  {
+  if( write_behind && buffer_size >= max_buffer_size && pos < buffer_size / 2 )
+    return buffer_size / 2;
+  return buffer_size;
+  }
+
+
+void LZ_decoder::flush_data( const bool wait )
   {
   const int size = pos - stream_pos;
   if( size > 0 )
     {
-    crc32.update( crc_, buffer + stream_pos, size );
-    if( outfd >= 0 &&
-        writeblock( outfd, buffer + stream_pos, size ) != size )
-      exit(-1);
-    if( pos >= buffer_size ) { partial_data_pos += pos; pos = 0; }
+    if( write_behind ) write_behind->wait();	// the last block is free
+    if( pos >= buffer_size && buffer_size < max_buffer_size )
+      grow_window();				// not yet wrapped
+    if( write_behind )
+      {
+      write_behind->start( buffer + stream_pos, size );
+      if( wait ) write_behind->wait();
+      }
+    else
+      {
+      crc32.update( crc_, buffer + stream_pos, size );
+      if( mem_writer ) mem_writer->write( buffer + stream_pos, size );
+      else if( outfd >= 0 &&
+               writeblock( outfd, buffer + stream_pos, size ) != size )
+        throw Error( "Write error" );
+      }
+    if( pos >= buffer_size )
+      { partial_data_pos += buffer_size; pos -= buffer_size; }
     stream_pos = pos;
+    flush_limit = next_flush_limit();
+    }
+  else if( wait && write_behind ) write_behind->wait();
+  }
+
+
+int LZ_decoder::read_data( uint8_t * const outbuf, const int size )
+  {
+  int rd = 0;
+  while( rd < size && get_pos != pos )
+    {
+    const int end = ( get_pos < pos ) ? pos : buffer_size;
+    const int n = min( size - rd, end - get_pos );
+    memcpy( outbuf + rd, buffer + get_pos, n );
+    rd += n;
+    get_pos += n;
+    if( get_pos >= buffer_size ) get_pos = 0;
     }
+  return rd;
   }
 
 
@@ -118,7 +516,6 @@ bool LZ_decoder::verify_trailer() const
   if( !range_decoder.code_is_zero() )
     {
     error = true;
-    pp( "Range decoder final code is not zero" );
     }
   if( trailer.data_crc() != crc() )
     {
@@ -136,117 +533,328 @@ bool LZ_decoder::verify_trailer() const
   }
 
 
-// Return value: 0 = OK, 1 = decoder error, 2 = unexpected EOF,
-//               3 = trailer error, 4 = unknown marker found.
-int LZ_decoder::decode_member()
+// Decodes a match or a repeated match, whose first bit has been decoded
+// already, and sets 'st' to the state that follows it. As 'char_state'
+// tells whether the previous symbol was a literal, the next state is a
+// constant. Returns -1 if the match was decoded, -2 after a sync flush
+// marker (the state is not changed), or the result of 'decode_member'.
+//
+// In linear mode the data never wraps around, so a distance is valid if
+// it is within the data decoded. With trusted input, distances are only
+// checked to be within the window, which is enough to access memory
+// safely; corrupt data is then detected by the CRC in the trailer.
+//
+template< bool char_state, bool linear_out, bool trusted >
+int LZ_decoder::decode_match( int & st, const int pos_state )
   {
-  Bit_model bm_match[State::states][pos_states];
-  Bit_model bm_rep[State::states];
-  Bit_model bm_rep0[State::states];
-  Bit_model bm_rep1[State::states];
-  Bit_model bm_rep2[State::states];
-  Bit_model bm_len[State::states][pos_states];
-  Bit_model bm_dis_slot[max_dis_states][1<<dis_slot_bits];
-  Bit_model bm_dis[modeled_distances-end_dis_model+1];
-  Bit_model bm_align[dis_align_size];
-
-  unsigned int rep0 = 0;	// rep[0-3] latest four distances
-  unsigned int rep1 = 0;	// used for efficient coding of
-  unsigned int rep2 = 0;	// repeated distances
-  unsigned int rep3 = 0;
-
-  Len_decoder len_decoder;
-  Len_decoder rep_match_len_decoder;
-  Literal_decoder literal_decoder;
-  State state;
-  range_decoder.load();
-
-  while( true )
+  int len;
+  if( range_decoder.decode_bit( state_models[st].rep ) == 1 )
     {
-    if( range_decoder.finished() ) { flush_data(); return 2; }
-    const int pos_state = data_position() & pos_state_mask;
-    if( range_decoder.decode_bit( bm_match[state()][pos_state] ) == 0 )
+    if( range_decoder.decode_bit( state_models[st].rep0 ) == 0 )
+      {
+      if( range_decoder.decode_bit( state_models[st].len[pos_state] ) == 0 )
+        {
+        st = char_state ? 9 : 11;		// short rep
+        put_byte( get_byte( rep0 ) );
+        return -1;
+        }
+      }
+    else
       {
-      const uint8_t prev_byte = get_prev_byte();
-      if( state.is_char() )
-        put_byte( literal_decoder.decode( range_decoder, prev_byte ) );
+      unsigned int distance;
+      if( range_decoder.decode_bit( state_models[st].rep1 ) == 0 )
+        distance = rep1;
       else
-        put_byte( literal_decoder.decode_matched( range_decoder, prev_byte,
-                                                  get_byte( rep0 ) ) );
-      state.set_char();
+        {
+        if( range_decoder.decode_bit( state_models[st].rep2 ) == 0 )
+          distance = rep2;
+        else { distance = rep3; rep3 = rep2; }
+        rep2 = rep1;
+        }
+      rep1 = rep0;
+      rep0 = distance;
       }
+    prefetch( rep0 );
+    st = char_state ? 8 : 11;			// rep
+    len = min_match_len + rep_match_len_decoder.decode( range_decoder, pos_state );
+    prefetch( rep0, len );
+    }
+  else
+    {
+    const unsigned int rep0_saved = rep0;
+    len = min_match_len + len_decoder.decode( range_decoder, pos_state );
+    const int dis_slot = range_decoder.decode_tree( bm_dis_slot[get_dis_state(len)], dis_slot_bits );
+    if( dis_slot < start_dis_model ) rep0 = dis_slot;
     else
       {
-      int len;
-      if( range_decoder.decode_bit( bm_rep[state()] ) == 1 )
+      const int direct_bits = ( dis_slot >> 1 ) - 1;
+      rep0 = ( 2 | ( dis_slot & 1 ) ) << direct_bits;
+      if( dis_slot < end_dis_model )
+        rep0 += range_decoder.decode_tree_reversed( bm_dis + rep0 - dis_slot, direct_bits );
+      else
         {
-        len = 0;
-        if( range_decoder.decode_bit( bm_rep0[state()] ) == 1 )
+        rep0 += range_decoder.decode( direct_bits - dis_align_bits ) << dis_align_bits;
+        prefetch( rep0, len );		// the align bits move it by < 16 bytes
+        rep0 += range_decoder.decode_tree_reversed( bm_align, dis_align_bits );
+        if( rep0 == 0xFFFFFFFFU )		// Marker found
           {
-          unsigned int distance;
-          if( range_decoder.decode_bit( bm_rep1[state()] ) == 0 )
-            distance = rep1;
-          else
+          rep0 = rep0_saved;
+          range_decoder.normalize();
+          flush_data();
+          if( len == min_match_len )	// End Of Stream marker
             {
-            if( range_decoder.decode_bit( bm_rep2[state()] ) == 0 )
-              distance = rep2;
-            else { distance = rep3; rep3 = rep2; }
-            rep2 = rep1;
+            if( verify_trailer() ) return 0; else return 3;
             }
-          rep1 = rep0;
-          rep0 = distance;
-          }
-        else
-          {
-          if( range_decoder.decode_bit( bm_len[state()][pos_state] ) == 0 )
-            { state.set_short_rep(); len = 1; }
-          }
-        if( len == 0 )
-          {
-          state.set_rep();
-          len = min_match_len + rep_match_len_decoder.decode( range_decoder, pos_state );
+          if( len == min_match_len + 1 )	// Sync Flush marker
+            {
+            range_decoder.load(); return -2;
+            }
+          return 4;
           }
         }
-      else
+      }
+    rep3 = rep2; rep2 = rep1; rep1 = rep0_saved;
+    st = char_state ? 7 : 10;			// match
+    if( trusted ? rep0 >= (unsigned int)buffer_size :
+        rep0 >= (unsigned int)dictionary_size ||
+        ( rep0 >= (unsigned int)pos && ( linear_out || !partial_data_pos ) ) )
+      { flush_data(); return 1; }
+    }
+  copy_block( rep0, len );
+  return -1;
+  }
+
+
+// The state (see class State) is kept in 'st', and whether it is a char
+// state (the previous symbol was a literal) is kept in the control flow,
+// so that the state transitions need neither tables nor branches.
+// 'push' is true when the output is returned by 'read_data'.
+//
+template< bool push, bool linear_out, bool trusted >
+int LZ_decoder::decode_loop()
+  {
+  int st = state;
+  int result;
+  if( st >= 7 ) goto match_state;
+
+char_state:				// st < 7
+  while( true )
+    {
+    if( ( result = pause_result< push >() ) >= 0 ) goto done;
+    const int pos_state = data_position() & pos_state_mask;
+    if( range_decoder.decode_bit( state_models[st].match[pos_state] ) == 0 )
+      {
+      put_byte( literal_decoder.decode( range_decoder,
+                                        get_prev_byte< linear_out >() ) );
+      st = ( st < 4 ) ? 0 : st - 3;
+      continue;
+      }
+    result = decode_match< true, linear_out, trusted >( st, pos_state );
+    if( result == -1 ) goto match_state;
+    if( result >= 0 ) goto done;
+    }
+
+match_state:				// st >= 7
+  while( true )
+    {
+    if( ( result = pause_result< push >() ) >= 0 ) goto done;
+    const int pos_state = data_position() & pos_state_mask;
+    if( range_decoder.decode_bit( state_models[st].match[pos_state] ) == 0 )
+      {
+      put_byte( literal_decoder.decode_matched( range_decoder,
+                  get_prev_byte< linear_out >(), get_byte( rep0 ) ) );
+      st = ( st < 10 ) ? st - 3 : st - 6;
+      goto char_state;
+      }
+    result = decode_match< false, linear_out, trusted >( st, pos_state );
+    if( result >= 0 ) goto done;
+    }
+
+done:
+  state = st;
+  return result;
+  }
+
+
+// Return value: 0 = OK, 1 = decoder error, 2 = unexpected EOF,
+//               3 = trailer error, 4 = unknown marker found,
+//               5 = more input needed, 6 = output must be read first.
+// Values 5 and 6 are only returned when decoding from 'write_data'
+// or into 'read_data'; calling again resumes decoding.
+//
+// Each mode of use runs a loop compiled with only the checks it needs.
+// Testing needs no loop of its own, as the output is only written when
+// the window wraps around, which is not per symbol.
+//
+int LZ_decoder::decode_member()
+  {
+  const int result = load_result();
+  if( result >= 0 ) return result;
+  if( user_reads )
+    return trusted ? decode_loop< true, false, true >() :
+                     decode_loop< true, false, false >();
+  if( linear )
+    return trusted ? decode_loop< false, true, true >() :
+                     decode_loop< false, true, false >();
+  return trusted ? decode_loop< false, false, true >() :
+                   decode_loop< false, false, false >();
+  }
+
+
+// Decodes one symbol in linear mode, keeping the state in 'state'.
+// Returns -1, or the result of 'decode_member' if decoding has stopped.
+//
+template< bool trusted >
+int LZ_decoder::decode_symbol()
+  {
+  int result = pause_result< false >();
+  if( result >= 0 ) return result;
+  const int pos_state = data_position() & pos_state_mask;
+  int st = state;
+  if( range_decoder.decode_bit( state_models[st].match[pos_state] ) == 0 )
+    {
+    if( st < 7 )
+      {
+      put_byte( literal_decoder.decode( range_decoder,
+                                        get_prev_byte< true >() ) );
+      state = ( st < 4 ) ? 0 : st - 3;
+      }
+    else
+      {
+      put_byte( literal_decoder.decode_matched( range_decoder,
+                  get_prev_byte< true >(), get_byte( rep0 ) ) );
+      state = ( st < 10 ) ? st - 3 : st - 6;
+      }
+    return -1;
+    }
+  if( st < 7 ) result = decode_match< true, true, trusted >( st, pos_state );
+  else result = decode_match< false, true, trusted >( st, pos_state );
+  state = st;
+  return ( result == -2 ) ? -1 : result;
+  }
+
+
+// Decodes one symbol of each of the 'n' decoders in 'd' by turns, until
+// some of them stop. The results are stored in 'result'.
+//
+template< int n, bool trusted >
+void LZ_decoder::decode_group( LZ_decoder * const d[], int result[] )
+  {
+  for( int i = 0; i < n; ++i )
+    if( ( result[i] = d[i]->load_result() ) >= 0 ) return;
+  while( true )
+    {
+    bool stop = ( ( result[0] = d[0]->decode_symbol< trusted >() ) >= 0 );
+    if( n > 1 && ( result[1] = d[1]->decode_symbol< trusted >() ) >= 0 ) stop = true;
+    if( n > 2 && ( result[2] = d[2]->decode_symbol< trusted >() ) >= 0 ) stop = true;
+    if( n > 3 && ( result[3] = d[3]->decode_symbol< trusted >() ) >= 0 ) stop = true;
+    if( stop ) return;
+    }
+  }
+
+
+namespace {
+
+File_header member_header( const uint8_t * const p )
+  {
+  File_header header;
+  memcpy( header.data, p, File_header::size );
+  return header;
+  }
+
+
+// A member decoded from its own part of the input into its own part of
+// the output, independently of the other members.
+struct Member_decoder
+  {
+  const unsigned index;
+  const long long member_pos;
+  Mem_reader reader;
+  Range_decoder rdec;
+  LZ_decoder decoder;
+
+  Member_decoder( const uint8_t * const buf, const Member_info & member,
+                  const unsigned i, uint8_t * const outbuf )
+    :
+    index( i ),
+    member_pos( member.pos ),
+    reader( buf + member.pos, member.size ),
+    rdec( -1, &reader ),
+    decoder( member_header( buf + member.pos ), rdec, outbuf,
+             member.data_size )
+    {				// skip the header
+    for( int i = 0; i < File_header::size && !rdec.finished(); ++i )
+      rdec.get_byte();
+    }
+
+  long long error_pos() const
+    { return member_pos + rdec.member_position(); }
+  };
+
+} // end namespace
+
+
+int decode_members( const uint8_t * const buf,
+                    const std::vector< Member_info > & members,
+                    uint8_t * const outbuf, const bool trusted,
+                    unsigned & failed, long long & error_pos )
+  {
+  const int max_n = ( INTERLEAVED_MEMBERS < 1 ) ? 1 :
+                    ( INTERLEAVED_MEMBERS > 4 ) ? 4 : INTERLEAVED_MEMBERS;
+  Member_decoder * md[4];
+  LZ_decoder * d[4];
+  int result[4];
+  int n = 0;				// members being decoded
+  unsigned next = 0;			// next member to start
+  long long data_pos = 0;
+  int retval = 0;
+  try {
+    while( true )
+      {
+      while( n < max_n && next < members.size() )
+        {
+        md[n] = new Member_decoder( buf, members[next], next, outbuf + data_pos );
+        md[n]->decoder.trust_input( trusted );
+        d[n] = &md[n]->decoder;
+        data_pos += members[next].data_size; ++next; ++n;
+        }
+      if( n == 0 ) break;
+      if( n == 1 ) result[0] = d[0]->decode_member();
+      else if( trusted ) switch( n )
         {
-        const unsigned int rep0_saved = rep0;
-        len = min_match_len + len_decoder.decode( range_decoder, pos_state );
-        const int dis_slot = range_decoder.decode_tree( bm_dis_slot[get_dis_state(len)], dis_slot_bits );
-        if( dis_slot < start_dis_model ) rep0 = dis_slot;
-        else
+        case 2: LZ_decoder::decode_group< 2, true >( d, result ); break;
+        case 3: LZ_decoder::decode_group< 3, true >( d, result ); break;
+        default: LZ_decoder::decode_group< 4, true >( d, result );
+        }
+      else switch( n )
+        {
+        case 2: LZ_decoder::decode_group< 2, false >( d, result ); break;
+        case 3: LZ_decoder::decode_group< 3, false >( d, result ); break;
+        default: LZ_decoder::decode_group< 4, false >( d, result );
+        }
+      int j = 0;			// remove the members finished
+      for( int i = 0; i < n; ++i )
+        {
+        if( result[i] > 0 && retval == 0 )
           {
-          const int direct_bits = ( dis_slot >> 1 ) - 1;
-          rep0 = ( 2 | ( dis_slot & 1 ) ) << direct_bits;
-          if( dis_slot < end_dis_model )
-            rep0 += range_decoder.decode_tree_reversed( bm_dis + rep0 - dis_slot, direct_bits );
-          else
-            {
-            rep0 += range_decoder.decode( direct_bits - dis_align_bits ) << dis_align_bits;
-            rep0 += range_decoder.decode_tree_reversed( bm_align, dis_align_bits );
-            if( rep0 == 0xFFFFFFFFU )		// Marker found
-              {
-              rep0 = rep0_saved;
-              range_decoder.normalize();
-              flush_data();
-              if( len == min_match_len )	// End Of Stream marker
-                {
-                if( verify_trailer() ) return 0; else return 3;
-                }
-              if( len == min_match_len + 1 )	// Sync Flush marker
-                {
-                range_decoder.load(); continue;
-                }
-              return 4;
-              }
-            }
+          // Finish the members before this one, which may fail first.
+          for( int k = 0; k < i && retval == 0; ++k )
+            if( result[k] < 0 && ( result[k] = d[k]->decode_member() ) > 0 )
+              { retval = result[k]; failed = md[k]->index;
+                error_pos = md[k]->error_pos(); }
+          if( retval == 0 )
+            { retval = result[i]; failed = md[i]->index;
+              error_pos = md[i]->error_pos(); }
           }
-        rep3 = rep2; rep2 = rep1; rep1 = rep0_saved;
-        state.set_match();
-        if( rep0 >= (unsigned int)dictionary_size ||
-            ( rep0 >= (unsigned int)pos && !partial_data_pos ) )
-          { flush_data(); return 1; }
+        if( result[i] >= 0 ) delete md[i];
+        else { md[j] = md[i]; d[j] = d[i]; ++j; }
         }
-      copy_block( rep0, len );
+      n = j;
+      if( retval != 0 ) break;
       }
     }
+  catch( std::bad_alloc & )
+    { for( int i = 0; i < n; ++i ) delete md[i]; throw; }
+  for( int i = 0; i < n; ++i ) delete md[i];
+  return retval;
   }
@@ -15,47 +15,124 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef MIRRORED_WINDOW
+#define MIRRORED_WINDOW 0
+#endif
+
+// If UNROLLED_LITERALS is defined to 1, literals are decoded with an
+// unrolled tree instead of the generic loop.
+#ifndef UNROLLED_LITERALS
+#define UNROLLED_LITERALS 1
+#endif
+
+// If MASKED_MATCHED_LITERALS is defined to 1, matched literals are decoded
+// with one branch-free loop instead of two. It is faster on data with few
+// matches, but slower on text, where matched literals are predictable.
+#ifndef MASKED_MATCHED_LITERALS
+#define MASKED_MATCHED_LITERALS 0
+#endif
+
+// If PREFETCH_MATCHES is defined to 0, the source of far matches is not
+// prefetched. Only useful for measuring the effect of the prefetch.
+#ifndef PREFETCH_MATCHES
+#define PREFETCH_MATCHES 1
+#endif
+
+// Number of members decoded at once by 'decode_members' (1 to 4). Range
+// decoding is a serial chain of dependent operations; decoding several
+// independent members by turns lets the core overlap their chains, but
+// their mispredicted branches are not independent, and the state can't be
+// kept in the control flow, so it is usually slower than one at a time.
+#ifndef INTERLEAVED_MEMBERS
+#define INTERLEAVED_MEMBERS 1
+#endif
+
+
 class Range_decoder
   {
-  enum { buffer_size = 16384 };
+  enum { buffer_size = 16384,
+         max_window_size = 1 << 30 };	// memory read in place per block
   long long partial_member_pos;
-  uint8_t * const buffer;	// input buffer
+  uint8_t * const block;	// input buffer, unused with mem_reader alone
+  const uint8_t * buffer;	// data being decoded (block or mem_reader)
   int pos;			// current pos in buffer
   int stream_pos;		// when reached, a new block must be read
   uint32_t code;
   uint32_t range;
   const int infd;		// input file descriptor
+  Mem_reader * const mem_reader;	// read before infd if not null
   bool at_stream_end;
 
+public:
+  // Longest symbol plus a trailer. Decoding of a symbol does not start
+  // with less than this in the buffer unless at end of stream.
+  enum { min_available_bytes = 48 };
+
+private:
+  // The last bytes of the stream are decoded from 'tail', which is padded
+  // with 0x55 so that reading past the end needs no check and makes
+  // code != 0, as reading a truncated stream always did.
+  uint8_t tail[2*min_available_bytes];
+
   bool read_block();
 
 public:
-  Range_decoder( const int ifd )
+
+       // If neither 'ifd' nor 'mr' is given, data must be supplied
+       // with 'write_data' and end of stream marked with 'finish'. If
+       // both are given, the stream continues in 'ifd' after 'mr'.
+  Range_decoder( const int ifd = -1, Mem_reader * const mr = 0 )
     :
     partial_member_pos( 0 ),
-    buffer( new uint8_t[buffer_size] ),
+    block( ( ifd >= 0 || !mr ) ? new uint8_t[buffer_size] : 0 ),
+    buffer( mr ? 0 : block ),
     pos( 0 ),
     stream_pos( 0 ),
     code( 0 ),
     range( 0xFFFFFFFFU ),
     infd( ifd ),
-    at_stream_end( false ) {}
+    mem_reader( mr ),
+    at_stream_end( false )
+    { memset( tail, 0x55, sizeof tail ); }
 
-  ~Range_decoder() { delete[] buffer; }
+  ~Range_decoder() { delete[] block; }
+
+       // Prepares for a new stream from the same kind of source. With
+       // 'mem_reader', the reader must have been given the new data.
+  void reset()
+    {
+    partial_member_pos = 0;
+    buffer = mem_reader ? 0 : block;
+    pos = 0;
+    stream_pos = 0;
+    code = 0;
+    range = 0xFFFFFFFFU;
+    at_stream_end = false;
+    memset( tail, 0x55, sizeof tail );
+    }
 
   bool code_is_zero() const { return ( code == 0 ); }
   bool finished() { return pos >= stream_pos && !read_block(); }
   long long member_position() const
-    { return partial_member_pos + pos; }
+    { return partial_member_pos + min( pos, stream_pos ); }
   void reset_member_position()
     { partial_member_pos = -pos; }
 
-  uint8_t get_byte()
+  int available_bytes() const { return stream_pos - pos; }
+  bool at_end() const { return at_stream_end; }
+  void finish() { at_stream_end = true; }
+  int write_data( const uint8_t * const inbuf, const int size );
+
+  bool enough_available_bytes()
     {
-    if( finished() ) return 0x55;		// make code != 0
-    return buffer[pos++];
+    if( stream_pos - pos < min_available_bytes ) read_block();
+    return ( stream_pos - pos >= min_available_bytes || at_stream_end );
     }
 
+  // Callers ensure that data is available, either by checking
+  // 'finished' or once per symbol with 'enough_available_bytes'.
+  uint8_t get_byte() { return buffer[pos++]; }
+
   void load()
     {
     code = 0;
@@ -69,26 +146,29 @@ public:
       { range <<= 8; code = (code << 8) | get_byte(); }
     }
 
+       // Direct bits. Each bit halves range, so after normalizing, the
+       // bits decoded until range drops below 2^24 need no check.
   int decode( const int num_bits )
     {
-    int symbol = 0;
-    for( int i = num_bits; i > 0; --i )
+    uint32_t symbol = 0;
+    for( int i = num_bits; i > 0; )
       {
-      symbol <<= 1;
-      if( range <= 0x00FFFFFFU )
-        {
-        range <<= 7; code = (code << 8) | get_byte();
-        if( code >= range ) { code -= range; symbol |= 1; }
-        }
-      else
+      normalize();
+      int n = 8 - __builtin_clz( range );	// range >= 2^24, so n >= 1
+      if( n > i ) n = i;
+      i -= n;
+      while( --n >= 0 )
         {
         range >>= 1;
-        if( code >= range ) { code -= range; symbol |= 1; }
+        const uint32_t mask = 0U - ( code >= range );
+        code -= range & mask;
+        symbol = ( symbol << 1 ) | ( mask & 1 );
         }
       }
     return symbol;
     }
 
+       // Used for decisions, which are usually well predicted.
   int decode_bit( Bit_model & bm )
     {
     normalize();
@@ -106,6 +186,24 @@ public:
       bm.probability -= bm.probability >> bit_model_move_bits;
       return 1;
       }
+    }
+
+       // Same as 'decode_bit', without data-dependent branches. Used for
+       // the trees of literals and of distance bits, whose bits are about
+       // as random as the data. The trees of lengths and of slots are
+       // predictable enough for 'decode_bit' to be faster.
+  int decode_bit_masked( Bit_model & bm )
+    {
+    normalize();
+    const uint32_t p = bm.probability;
+    const uint32_t bound = ( range >> bit_model_total_bits ) * p;
+    const uint32_t mask = 0U - ( code >= bound );	// all ones if bit is 1
+    range = ( bound & ~mask ) | ( ( range - bound ) & mask );
+    code -= bound & mask;
+    bm.probability =
+      ( ( p + ( ( bit_model_total - p ) >> bit_model_move_bits ) ) & ~mask ) |
+      ( ( p - ( p >> bit_model_move_bits ) ) & mask );
+    return mask & 1;
     }
 
   int decode_tree( Bit_model bm[], const int num_bits )
@@ -116,19 +214,58 @@ public:
     return model - (1 << num_bits);
     }
 
+  int decode_tree8_masked( Bit_model bm[] )
+    {
+#if UNROLLED_LITERALS
+    int model = 1;
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+    model = ( model << 1 ) | decode_bit_masked( bm[model] );
+#else
+    int model = 1;
+    for( int i = 8; i > 0; --i )
+      model = ( model << 1 ) | decode_bit_masked( bm[model] );
+#endif
+    return model - 0x100;
+    }
+
   int decode_tree_reversed( Bit_model bm[], const int num_bits )
     {
     int model = 1;
     int symbol = 0;
     for( int i = 0; i < num_bits; ++i )
       {
-      const int bit = decode_bit( bm[model] );
-      model <<= 1;
-      if( bit ) { model |= 1; symbol |= (1 << i); }
+      const int bit = decode_bit_masked( bm[model] );
+      model = ( model << 1 ) | bit;
+      symbol |= bit << i;
       }
     return symbol;
     }
 
+#if MASKED_MATCHED_LITERALS
+       // 'offset' is 0x100 while the decoded bits equal those of
+       // 'match_byte' (using the models at bm + 0x100), and 0 after the
+       // first difference, so the same loop decodes both parts.
+  int decode_matched( Bit_model bm[], int match_byte )
+    {
+    int offset = 0x100;
+    int symbol = 1;
+    do {
+      match_byte <<= 1;
+      const int match_bit = match_byte & offset;
+      const int bit = decode_bit_masked( bm[offset+match_bit+symbol] );
+      symbol = ( symbol << 1 ) | bit;
+      offset = match_bit ^ ( offset & ( bit - 1 ) );
+      }
+    while( symbol < 0x100 );
+    return symbol & 0xFF;
+    }
+#else
   int decode_matched( Bit_model bm[], const int match_byte )
     {
     Bit_model * const bm1 = bm + 0x100;
@@ -141,12 +278,13 @@ public:
       if( match_bit != bit )
         {
         while( --i >= 0 )
-          symbol = ( symbol << 1 ) | decode_bit( bm[symbol] );
+          symbol = ( symbol << 1 ) | decode_bit_masked( bm[symbol] );
         break;
         }
       }
     return symbol & 0xFF;
     }
+#endif
   };
 
 
@@ -159,6 +297,14 @@ class Len_decoder
   Bit_model bm_high[len_high_symbols];
 
 public:
+  void init()
+    {
+    choice1 = choice2 = Bit_model();
+    init_models( bm_low[0], pos_states * len_low_symbols );
+    init_models( bm_mid[0], pos_states * len_mid_symbols );
+    init_models( bm_high, len_high_symbols );
+    }
+
   int decode( Range_decoder & range_decoder, const int pos_state )
     {
     if( range_decoder.decode_bit( choice1 ) == 0 )
@@ -180,8 +326,11 @@ class Literal_decoder
     { return ( prev_byte >> ( 8 - literal_context_bits ) ); }
 
 public:
+  void init()
+    { init_models( bm_literal[0], ( 1 << literal_context_bits ) * 0x300 ); }
+
   uint8_t decode( Range_decoder & range_decoder, const uint8_t prev_byte )
-    { return range_decoder.decode_tree( bm_literal[lstate(prev_byte)], 8 ); }
+    { return range_decoder.decode_tree8_masked( bm_literal[lstate(prev_byte)] ); }
 
   uint8_t decode_matched( Range_decoder & range_decoder,
                           const uint8_t prev_byte, const uint8_t match_byte )
@@ -190,79 +339,332 @@ public:
   };
 
 
+struct Member_info
+  {
+  long long pos;		// position of the member in the input
+  long long size;		// member size, including header and trailer
+  long long data_size;		// size of the decompressed data
+  };
+
+// Fills 'members' with the members of the complete lzip data in 'buf',
+// read from their trailers backwards from the end. Returns false if the
+// data can't be indexed this way (no data, trailing garbage, version 0
+// members or implausible sizes); it must then be decoded without knowing
+// its size.
+bool index_members( const uint8_t * const buf, const long long size,
+                    std::vector< Member_info > & members );
+
+
+class Write_behind;
+
 class LZ_decoder
   {
   long long partial_data_pos;
-  const int dictionary_size;
-  const int buffer_size;
-  uint8_t * const buffer;	// output buffer
+  int dictionary_size;
+  int max_buffer_size;
+  int buffer_size;		// grows up to max_buffer_size until wrap
+  bool mirrored;		// buffer[buffer_size+i] is buffer[i]
+  const bool linear;		// buffer is the final destination
+  uint8_t * buffer;		// output buffer
+  uint8_t spare_byte;		// buffer of an empty member in linear mode
   int pos;			// current pos in buffer
   int stream_pos;		// first byte not yet written to file
+  int flush_limit;		// flush_data is called when pos reaches it
+  int get_pos;			// first byte not yet read with read_data
   uint32_t crc_;
   const int outfd;		// output file descriptor
-  const int member_version;
+  Mem_writer * const mem_writer;	// used instead of outfd if not null
+  Write_behind * write_behind;	// CRC and writes done by a helper thread
+  const bool user_reads;	// output is returned by read_data
+  bool trusted;			// input is known to be valid
+  int member_version;
   Range_decoder & range_decoder;
 
-  void flush_data();
+  State_models state_models[State::states];
+  Bit_model bm_dis_slot[max_dis_states][1<<dis_slot_bits];
+  Bit_model bm_dis[modeled_distances-end_dis_model+1];
+  Bit_model bm_align[dis_align_size];
+
+  unsigned int rep0;		// rep[0-3] latest four distances
+  unsigned int rep1;		// used for efficient coding of
+  unsigned int rep2;		// repeated distances
+  unsigned int rep3;
+
+  Len_decoder len_decoder;
+  Len_decoder rep_match_len_decoder;
+  Literal_decoder literal_decoder;
+  int state;			// see State; kept in a local while decoding
+  bool load_pending;		// range decoder not yet loaded
+
+  static uint8_t * new_window( int & size, const int max_size,
+                               bool & mirrored );
+  static void delete_window( uint8_t * const p, const int size,
+                             const bool mirrored );
+
+  void grow_window();
+       // With 'wait' false, the data may still be in use by the write-behind
+       // thread on return; it is only allowed when the window is full.
+  void flush_data( const bool wait = true );
+  int next_flush_limit() const;
   bool verify_trailer() const;
-
-  uint8_t get_prev_byte() const
+  template< bool char_state, bool linear_out, bool trusted >
+  int decode_match( int & st, const int pos_state );
+  template< bool push, bool linear_out, bool trusted > int decode_loop();
+  template< bool trusted > int decode_symbol();
+  template< int n, bool trusted >
+  static void decode_group( LZ_decoder * const d[], int result[] );
+  friend int decode_members( const uint8_t * const buf,
+                             const std::vector< Member_info > & members,
+                             uint8_t * const outbuf, const bool trusted,
+                             unsigned & failed, long long & error_pos );
+
+       // In linear mode the data before the first byte is not ours.
+  template< bool linear_out > uint8_t get_prev_byte() const
     {
+    if( linear_out ) return ( pos > 0 ) ? buffer[pos-1] : 0;
+    if( MIRRORED_WINDOW && mirrored ) return buffer[pos+buffer_size-1];
     const int i = ( ( pos > 0 ) ? pos : buffer_size ) - 1;
     return buffer[i];
     }
 
   uint8_t get_byte( const int distance ) const
     {
+    if( MIRRORED_WINDOW && mirrored )
+      return buffer[pos+buffer_size-distance-1];
     int i = pos - distance - 1;
     if( i < 0 ) i += buffer_size;
     return buffer[i];
+    }
+
+       // Hints the cache to fetch the bytes from 'distance' + 1 back to
+       // 'len' bytes later, the source of a match and the byte matched by
+       // the literal following it. Never faults, even if 'distance' is
+       // invalid.
+  void prefetch( const unsigned int distance, const int len = 0 ) const
+    {
+    if( !PREFETCH_MATCHES ) return;
+    int i = pos - distance - 1;
+    if( i < 0 ) i += buffer_size;
+    __builtin_prefetch( buffer + i );
+    if( len > 0 ) __builtin_prefetch( buffer + i + len );
     }
 
   void put_byte( const uint8_t b )
     {
     buffer[pos] = b;
-    if( ++pos >= buffer_size ) flush_data();
+    if( ++pos >= flush_limit ) flush_data( false );
+    }
+
+       // Copies 'len' bytes from 'src' to 'dst' as if one byte at a time.
+       // If 'src' is less than 'len' bytes behind 'dst', the bytes between
+       // them are repeated. No byte after 'dst + len' is written.
+  static void copy_bytes( uint8_t * const dst, const uint8_t * const src,
+                          const int len )
+    {
+    const int d = dst - src;
+    if( d <= 0 || d >= len ) { memmove( dst, src, len ); return; }
+    if( d == 1 ) { memset( dst, *src, len ); return; }
+    int period = d;			// multiple of d, at least 16
+    while( period < 16 ) period += d;
+    int n = min( period - d, len );
+    for( int k = 0; k < n; ++k ) dst[k] = src[k];
+    for( ; n + 16 <= len; n += 16 )
+      memcpy( dst + n, dst + n - period, 16 );
+    if( n + 8 <= len ) { memcpy( dst + n, dst + n - period, 8 ); n += 8; }
+    for( ; n < len; ++n ) dst[n] = dst[n-d];
     }
 
   void copy_block( const int distance, int len )
     {
+    const int d = distance + 1;
+    if( MIRRORED_WINDOW && mirrored && len <= buffer_size - d )
+      {
+      // Source and destination are contiguous in one of the two views.
+      // If the destination runs into the second view, the start of the
+      // buffer is overwritten, so it must be flushed first.
+      uint8_t * const dst = buffer + pos + ( ( pos < d ) ? buffer_size : 0 );
+      if( pos + len > buffer_size ) flush_data( false );
+      copy_bytes( dst, dst - d, len );
+      pos += len;
+      if( pos >= buffer_size ) flush_data( false );
+      return;
+      }
     int i = pos - distance - 1;
     if( i < 0 ) i += buffer_size;
-    if( len < buffer_size - max( pos, i ) && len <= abs( pos - i ) )
+    if( len < min( flush_limit - pos, buffer_size - i ) )	// no wrap-around
       {
-      memcpy( buffer + pos, buffer + i, len );
+      copy_bytes( buffer + pos, buffer + i, len );
       pos += len;
       }
-    else for( ; len > 0; --len )
+    else while( len > 0 )
       {
-      buffer[pos] = buffer[i];
-      if( ++pos >= buffer_size ) flush_data();
-      if( ++i >= buffer_size ) i = 0;
+      const int n = min( len, min( flush_limit - pos, buffer_size - i ) );
+      copy_bytes( buffer + pos, buffer + i, n );
+      pos += n; i += n; len -= n;
+      if( pos >= flush_limit ) flush_data( false );
+      if( i >= buffer_size ) i = 0;
       }
     }
 
+       // room for the longest match without overwriting unread data
+  bool enough_free_bytes() const
+    {
+    int free_bytes = get_pos - pos - 1;
+    if( free_bytes < 0 ) free_bytes += buffer_size;
+    return ( free_bytes >= max_match_len );
+    }
+
+       // Returns the result of 'decode_member' if decoding must stop
+       // before the next symbol, or -1.
+  template< bool push > int pause_result()
+    {
+    if( !range_decoder.enough_available_bytes() ) return 5;
+    if( range_decoder.finished() ) { flush_data(); return 2; }
+    if( push && !enough_free_bytes() ) return 6;
+    return -1;
+    }
+
+       // Loads the range decoder at the start of the member. Returns 5 if
+       // more input is needed, else -1.
+  int load_result()
+    {
+    if( load_pending )
+      {
+      if( !range_decoder.enough_available_bytes() ) return 5;
+      range_decoder.load();
+      load_pending = false;
+      }
+    return -1;
+    }
+
+  static int linear_size( const uint8_t * const outbuf, const int data_size )
+    { return ( outbuf && data_size > 0 ) ? data_size : 1; }
+
+  void init()
+    {
+    state = 0;
+    rep0 = rep1 = rep2 = rep3 = 0;
+    load_pending = true;
+    if( !linear ) buffer[buffer_size-1] = 0;	// prev_byte of first_byte
+    }
+
 public:
-  LZ_decoder( const File_header & header, Range_decoder & rdec, const int ofd )
+  enum { min_buffer_size = 65536 };
+
+  LZ_decoder( const File_header & header, Range_decoder & rdec, const int ofd,
+              Mem_writer * const mw = 0 )
     :
     partial_data_pos( 0 ),
     dictionary_size( header.dictionary_size() ),
-    buffer_size( max( 65536, dictionary_size ) ),
-    buffer( new uint8_t[buffer_size] ),
+    max_buffer_size( max( (int)min_buffer_size, dictionary_size ) ),
+    buffer_size( min_buffer_size ),
+    mirrored( false ),
+    linear( false ),
+    buffer( new_window( buffer_size, max_buffer_size, mirrored ) ),
     pos( 0 ),
     stream_pos( 0 ),
+    flush_limit( buffer_size ),
+    get_pos( 0 ),
     crc_( 0xFFFFFFFFU ),
     outfd( ofd ),
+    mem_writer( mw ),
+    write_behind( 0 ),
+    user_reads( false ),
+    trusted( false ),
     member_version( header.version() ),
     range_decoder( rdec )
-    { buffer[buffer_size-1] = 0; }	// prev_byte of first_byte
+    { init(); }
 
-  ~LZ_decoder() { delete[] buffer; }
+       // Push mode. Decoded data must be collected with 'read_data'.
+  LZ_decoder( const File_header & header, Range_decoder & rdec )
+    :
+    partial_data_pos( 0 ),
+    dictionary_size( header.dictionary_size() ),
+    max_buffer_size( max( (int)min_buffer_size, dictionary_size ) ),
+    buffer_size( min_buffer_size ),
+    mirrored( false ),
+    linear( false ),
+    buffer( new_window( buffer_size, max_buffer_size, mirrored ) ),
+    pos( 0 ),
+    stream_pos( 0 ),
+    flush_limit( buffer_size ),
+    get_pos( 0 ),
+    crc_( 0xFFFFFFFFU ),
+    outfd( -1 ),
+    mem_writer( 0 ),
+    write_behind( 0 ),
+    user_reads( true ),
+    trusted( false ),
+    member_version( header.version() ),
+    range_decoder( rdec )
+    { init(); }
+
+       // Linear mode. The member, of known 'data_size', is decoded straight
+       // into 'outbuf'. Writes past 'data_size' wrap around, as in the
+       // circular buffer, so even a corrupt member never touches memory
+       // outside its own data, and members can be decoded at once into
+       // adjacent destinations. Without 'outbuf', or for an empty member,
+       // 'spare_byte' is used instead, and any data fails the trailer.
+  LZ_decoder( const File_header & header, Range_decoder & rdec,
+              uint8_t * const outbuf, const int data_size )
+    :
+    partial_data_pos( 0 ),
+    dictionary_size( min( header.dictionary_size(),
+                          linear_size( outbuf, data_size ) ) ),
+    max_buffer_size( linear_size( outbuf, data_size ) ),
+    buffer_size( max_buffer_size ),
+    mirrored( false ),
+    linear( true ),
+    buffer( ( outbuf && data_size > 0 ) ? outbuf : &spare_byte ),
+    pos( 0 ),
+    stream_pos( 0 ),
+    flush_limit( buffer_size ),
+    get_pos( 0 ),
+    crc_( 0xFFFFFFFFU ),
+    outfd( -1 ),
+    mem_writer( 0 ),
+    write_behind( 0 ),
+    user_reads( false ),
+    trusted( false ),
+    member_version( header.version() ),
+    range_decoder( rdec )
+    { spare_byte = 0; init(); }
+
+  ~LZ_decoder();
+
+  void reset( const File_header & header );
+
+       // Makes a helper thread compute the CRC of, and write, each half of
+       // the window while the other half is decoded. Returns false if the
+       // thread can't be created, or for a decoder not writing to 'outfd';
+       // the data is then flushed by the decoding thread.
+  bool start_write_behind();
+
+       // With trusted input, distances are not validated against the
+       // data decoded; corrupt input is still detected by the trailer.
+  void trust_input( const bool t ) { trusted = t; }
 
   uint32_t crc() const { return crc_ ^ 0xFFFFFFFFU; }
+       // memory allocated for the window; it only grows as data is decoded
+  int window_size() const { return linear ? 0 : buffer_size; }
 
   long long data_position() const
     { return partial_data_pos + pos; }
 
+  bool data_pending() const { return get_pos != pos; }
+  int read_data( uint8_t * const outbuf, const int size );
+
   int decode_member();
   };
+
+
+// Decodes the members of 'buf' listed by 'index_members' into 'outbuf',
+// which must have room for their data. Up to INTERLEAVED_MEMBERS members
+// are decoded at once, one symbol of each by turns. Returns 0 if all the
+// members are valid. Else returns the result of 'decode_member' for the
+// first member that failed, and stores its index in 'failed' and the
+// position of the error in 'error_pos'.
+int decode_members( const uint8_t * const buf,
+                    const std::vector< Member_info > & members,
+                    uint8_t * const outbuf, const bool trusted,
+                    unsigned & failed, long long & error_pos );
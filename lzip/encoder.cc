@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <new>
 
 #include "lzip.h"
 #include "encoder.h"
@@ -34,12 +36,14 @@ Prob_prices prob_prices;
 
 bool Matchfinder::read_block()
   {
-  if( !at_stream_end && stream_pos < buffer_size )
+  if( ( infd >= 0 || mem_reader ) &&
+      !at_stream_end && stream_pos < buffer_size )
     {
     const int size = buffer_size - stream_pos;
-    const int rd = readblock( infd, buffer + stream_pos, size );
+    const int rd = mem_reader ? mem_reader->read( buffer + stream_pos, size ) :
+                                readblock( infd, buffer + stream_pos, size );
     stream_pos += rd;
-    if( rd != size && errno ) throw Error( "Read error" );
+    if( rd != size && !mem_reader && errno ) throw Error( "Read error" );
     at_stream_end = ( rd < size );
     }
   return pos < stream_pos;
@@ -47,27 +51,30 @@ bool Matchfinder::read_block()
 
 
 Matchfinder::Matchfinder( const int dict_size, const int len_limit,
-                          const int ifd )
+                          const int ifd, Mem_reader * const mr )
   :
   partial_data_pos( 0 ),
-  prev_positions( new int32_t[num_prev_positions] ),
+  prev_positions( 0 ),
   pos( 0 ),
+  pos_offset( 0 ),
   cyclic_pos( 0 ),
   stream_pos( 0 ),
   match_len_limit_( len_limit ),
   cycles( ( len_limit < max_match_len ) ? 16 + ( len_limit / 2 ) : 256 ),
   infd( ifd ),
+  mem_reader( mr ),
   at_stream_end( false )
   {
   const int buffer_size_limit = ( 2 * dict_size ) + before_size + after_size;
   buffer_size = max( 65536, dict_size );
   buffer = (uint8_t *)malloc( buffer_size );
-  if( !buffer ) exit(-1);
+  if( !buffer ) throw std::bad_alloc();
   if( read_block() && !at_stream_end && buffer_size < buffer_size_limit )
     {
+    uint8_t * const tmp = (uint8_t *)realloc( buffer, buffer_size_limit );
+    if( !tmp ) { free( buffer ); throw std::bad_alloc(); }
+    buffer = tmp;
     buffer_size = buffer_size_limit;
-    buffer = (uint8_t *)realloc( buffer, buffer_size );
-    if( !buffer ) exit(-1);
     read_block();
     }
   if( at_stream_end && stream_pos < dict_size )
@@ -75,20 +82,89 @@ Matchfinder::Matchfinder( const int dict_size, const int len_limit,
   else dictionary_size_ = dict_size;
   pos_limit = buffer_size;
   if( !at_stream_end ) pos_limit -= after_size;
-  prev_pos_tree = new int32_t[2*dictionary_size_];
+  init_tables();
+  }
+
+
+Matchfinder::Matchfinder( const int dict_size, const int len_limit )
+  :
+  partial_data_pos( 0 ),
+  prev_positions( 0 ),
+  pos( 0 ),
+  pos_offset( 0 ),
+  cyclic_pos( 0 ),
+  stream_pos( 0 ),
+  match_len_limit_( len_limit ),
+  cycles( ( len_limit < max_match_len ) ? 16 + ( len_limit / 2 ) : 256 ),
+  infd( -1 ),
+  mem_reader( 0 ),
+  at_stream_end( false )
+  {
+  // input size is unknown, so the dictionary can't be shrunk
+  buffer_size = ( 2 * dict_size ) + before_size + after_size;
+  buffer = (uint8_t *)malloc( buffer_size );
+  if( !buffer ) throw std::bad_alloc();
+  dictionary_size_ = dict_size;
+  pos_limit = buffer_size - after_size;
+  init_tables();
+  }
+
+
+// Allocates about one hash head per position of the dictionary, so that
+// small inputs don't pay for the tables of a large dictionary.
+//
+void Matchfinder::init_tables()
+  {
+  num_prev_positions4 = min_prev_positions;
+  while( num_prev_positions4 < max_prev_positions4 &&
+         num_prev_positions4 < dictionary_size_ ) num_prev_positions4 <<= 1;
+  num_prev_positions2 = min( (int)max_prev_positions2, num_prev_positions4 );
+  num_prev_positions3 = max( num_prev_positions2, num_prev_positions4 / 4 );
+  num_prev_positions = num_prev_positions4 + num_prev_positions3 +
+                       num_prev_positions2;
+  // Smaller key2 or key3 tables are hashed, and their matches verified.
+  exact_keys = ( num_prev_positions3 >= max_prev_positions2 );
+  prev_positions = new( std::nothrow ) int32_t[num_prev_positions];
+  prev_pos_tree = new( std::nothrow ) int32_t[2*dictionary_size_];
+  if( !prev_positions || !prev_pos_tree )
+    {
+    delete[] prev_pos_tree; delete[] prev_positions; free( buffer );
+    throw std::bad_alloc();
+    }
   for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = -1;
   }
 
 
+int Matchfinder::write_data( const uint8_t * const inbuf, const int size ) throw()
+  {
+  const int sz = min( buffer_size - stream_pos, size );
+  if( !at_stream_end && sz > 0 )
+    {
+    memcpy( buffer + stream_pos, inbuf, sz );
+    stream_pos += sz;
+    return sz;
+    }
+  return 0;
+  }
+
+
 void Matchfinder::reset()
   {
   const int size = stream_pos - pos;
   if( size > 0 ) memmove( buffer, buffer + pos, size );
   partial_data_pos = 0;
+  // Moving the positions a dictionary past the old ones makes the tables
+  // look empty without clearing them.
+  const int skip = stream_pos + dictionary_size_;
+  if( pos_offset <= INT_MAX - buffer_size - skip ) pos_offset += skip;
+  else
+    {
+    pos_offset = 0;
+    for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = -1;
+    }
   stream_pos -= pos;
   pos = 0;
   cyclic_pos = 0;
-  for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = -1;
   read_block();
   }
 
@@ -99,7 +175,7 @@ void Matchfinder::move_pos()
   if( ++pos >= pos_limit )
     {
     if( pos > stream_pos )
-      internal_error( "pos > stream_pos in Matchfinder::move_pos" );
+      throw Error( "internal error: pos > stream_pos in Matchfinder::move_pos" );
     if( !at_stream_end )
       {
       const int offset = pos - dictionary_size_ - before_size;
@@ -108,17 +184,29 @@ void Matchfinder::move_pos()
       partial_data_pos += offset;
       pos -= offset;
       stream_pos -= offset;
-      for( int i = 0; i < num_prev_positions; ++i )
-        if( prev_positions[i] >= 0 ) prev_positions[i] -= offset;
-      for( int i = 0; i < 2 * dictionary_size_; ++i )
-        if( prev_pos_tree[i] >= 0 ) prev_pos_tree[i] -= offset;
+      // The tables keep their positions until they could overflow.
+      if( pos_offset <= INT_MAX - buffer_size - offset ) pos_offset += offset;
+      else
+        {
+        const int d = pos_offset + offset;
+        for( int i = 0; i < num_prev_positions; ++i )
+          if( prev_positions[i] >= 0 ) prev_positions[i] -= d;
+        for( int i = 0; i < 2 * dictionary_size_; ++i )
+          if( prev_pos_tree[i] >= 0 ) prev_pos_tree[i] -= d;
+        pos_offset = 0;
+        }
       read_block();
       }
     }
   }
 
 
-int Matchfinder::longest_match_len( int * const distances ) throw()
+// Adds the current position to the dictionary. If 'find_distances', also
+// stores in 'distances[len]' the distance - 1 of the nearest match of
+// each length found, and returns the longest length.
+//
+template< bool find_distances >
+int Matchfinder::find_matches( int * const distances ) throw()
   {
   int len_limit = match_len_limit_;
   if( len_limit > available_bytes() )
@@ -128,34 +216,38 @@ int Matchfinder::longest_match_len( int * const distances ) throw()
     }
 
   int maxlen = min_match_len - 1;
-  const int min_pos = (pos >= dictionary_size_) ?
-                      (pos - dictionary_size_ + 1) : 0;
+  const int tpos = pos + pos_offset;		// pos as kept in the tables
+  const int min_pos = (tpos >= dictionary_size_) ?
+                      (tpos - dictionary_size_ + 1) : 0;
   const uint8_t * const data = buffer + pos;
   const int key2 = num_prev_positions4 + num_prev_positions3 +
-                   ( ( (int)data[0] << 8 ) | data[1] );
+                   ( ( ( (int)data[0] << 8 ) | data[1] ) &
+                     ( num_prev_positions2 - 1 ) );
   const uint32_t tmp = crc32[data[0]] ^ data[1] ^ ( (uint32_t)data[2] << 8 );
   const int key3 = num_prev_positions4 +
                    (int)( tmp & ( num_prev_positions3 - 1 ) );
   const int key4 = (int)( ( tmp ^ ( crc32[data[3]] << 5 ) ) &
                           ( num_prev_positions4 - 1 ) );
 
-  if( distances )
+  if( find_distances )
     {
     int np = prev_positions[key2];
-    if( np >= min_pos )
-      { distances[2] = pos - np - 1; maxlen = 2; }
+    if( np >= min_pos && ( exact_keys ||
+        ( data[np-tpos] == data[0] && data[np-tpos+1] == data[1] ) ) )
+      { distances[2] = tpos - np - 1; maxlen = 2; }
     else distances[2] = 0x7FFFFFFF;
     np = prev_positions[key3];
-    if( np >= min_pos && buffer[np] == data[0] )
-      { distances[3] = pos - np - 1; maxlen = 3; }
+    if( np >= min_pos && data[np-tpos] == data[0] && ( exact_keys ||
+        ( data[np-tpos+1] == data[1] && data[np-tpos+2] == data[2] ) ) )
+      { distances[3] = tpos - np - 1; maxlen = 3; }
     else distances[3] = 0x7FFFFFFF;
     distances[4] = 0x7FFFFFFF;
     }
 
-  prev_positions[key2] = pos;
-  prev_positions[key3] = pos;
+  prev_positions[key2] = tpos;
+  prev_positions[key3] = tpos;
   int newpos = prev_positions[key4];
-  prev_positions[key4] = pos;
+  prev_positions[key4] = tpos;
 
   int32_t * ptr0 = prev_pos_tree + ( cyclic_pos << 1 );
   int32_t * ptr1 = ptr0 + 1;
@@ -164,11 +256,11 @@ int Matchfinder::longest_match_len( int * const distances ) throw()
   for( int count = cycles; ; )
     {
     if( newpos < min_pos || --count < 0 ) { *ptr0 = *ptr1 = -1; break; }
-    const uint8_t * const newdata = buffer + newpos;
-    while( len < len_limit && newdata[len] == data[len] ) ++len;
+    const int delta = tpos - newpos;
+    const uint8_t * const newdata = data - delta;
+    len += match_len( newdata + len, data + len, len_limit - len );
 
-    const int delta = pos - newpos;
-    if( distances ) while( maxlen < len ) distances[++maxlen] = delta - 1;
+    if( find_distances ) while( maxlen < len ) distances[++maxlen] = delta - 1;
 
     int32_t * const newptr = prev_pos_tree +
       ( ( cyclic_pos - delta +
@@ -198,7 +290,7 @@ int Matchfinder::longest_match_len( int * const distances ) throw()
       break;
       }
     }
-  if( distances )
+  if( find_distances )
     {
     if( distances[3] > distances[4] ) distances[3] = distances[4];
     if( distances[2] > distances[3] ) distances[2] = distances[3];
@@ -207,11 +299,19 @@ int Matchfinder::longest_match_len( int * const distances ) throw()
   }
 
 
+int Matchfinder::longest_match_len( int * const distances ) throw()
+  { return find_matches< true >( distances ); }
+
+
+void Matchfinder::skip_pos() throw() { find_matches< false >( 0 ); }
+
+
 void Range_encoder::flush_data()
   {
   if( pos > 0 )
     {
-    if( outfd >= 0 && writeblock( outfd, buffer, pos ) != pos )
+    if( mem_writer ) mem_writer->write( buffer, pos );
+    else if( outfd >= 0 && writeblock( outfd, buffer, pos ) != pos )
       throw Error( "Write error" );
     partial_member_pos += pos;
     pos = 0;
@@ -336,14 +436,14 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
   for( int i = 0; i < num_rep_distances; ++i ) trials[0].reps[i] = reps[i];
   trials[1].dis = -1;
   trials[1].prev_index = 0;
-  trials[1].price = price0( bm_match[state()][pos_state] );
+  trials[1].price = price0( state_models[state()].match[pos_state] );
   if( state.is_char() )
     trials[1].price += literal_encoder.price_symbol( prev_byte, cur_byte );
   else
     trials[1].price += literal_encoder.price_matched( prev_byte, cur_byte, match_byte );
 
-  const int match_price = price1( bm_match[state()][pos_state] );
-  const int rep_match_price = match_price + price1( bm_rep[state()] );
+  const int match_price = price1( state_models[state()].match[pos_state] );
+  const int rep_match_price = match_price + price1( state_models[state()].rep );
 
   if( match_byte == cur_byte )
     trials[1].update( 0, 0, rep_match_price + price_rep_len1( state, pos_state ) );
@@ -364,7 +464,8 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
     }
   else
     {
-    const int normal_match_price = match_price + price0( bm_rep[state()] );
+    const int normal_match_price =
+      match_price + price0( state_models[state()].rep );
     for( int len = min_match_len; len <= main_len; ++len )
       {
       trials[len].dis = match_distances[len] + num_rep_distances;
@@ -428,7 +529,7 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
     const uint8_t match_byte = matchfinder[-cur_trial.reps[0]-1];
 
     int next_price = cur_trial.price +
-                     price0( bm_match[cur_trial.state()][pos_state] );
+                     price0( state_models[cur_trial.state()].match[pos_state] );
     if( cur_trial.state.is_char() )
       next_price += literal_encoder.price_symbol( prev_byte, cur_byte );
     else
@@ -439,8 +540,9 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
 
     next_trial.update( -1, cur, next_price );
 
-    const int match_price = cur_trial.price + price1( bm_match[cur_trial.state()][pos_state] );
-    const int rep_match_price = match_price + price1( bm_rep[cur_trial.state()] );
+    const State_models & models = state_models[cur_trial.state()];
+    const int match_price = cur_trial.price + price1( models.match[pos_state] );
+    const int rep_match_price = match_price + price1( models.rep );
 
     if( match_byte == cur_byte && next_trial.dis != 0 )
       next_trial.update( 0, cur, rep_match_price +
@@ -453,9 +555,8 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
     for( int rep = 0; rep < num_rep_distances; ++rep )
       {
       const int dis = cur_trial.reps[rep] + 1;
-      int len = 0;
       const uint8_t * const data = matchfinder.ptr_to_current_pos() - 1;
-      while( len < len_limit && data[len] == data[len-dis] ) ++len;
+      int len = match_len( data, data - dis, len_limit );
       if( len >= min_match_len )
         {
         const int price = rep_match_price +
@@ -473,8 +574,7 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
           ( newlen == min_match_len &&
             match_distances[min_match_len] < modeled_distances ) ) )
       {
-      const int normal_match_price = match_price +
-                                     price0( bm_rep[cur_trial.state()] );
+      const int normal_match_price = match_price + price0( models.rep );
       while( num_trials < cur + newlen )
         trials[++num_trials].price = infinite_price;
 
@@ -506,8 +606,8 @@ int LZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
 void LZ_encoder::full_flush( const State & state )
   {
   const int pos_state = matchfinder.data_position() & pos_state_mask;
-  range_encoder.encode_bit( bm_match[state()][pos_state], 1 );
-  range_encoder.encode_bit( bm_rep[state()], 0 );
+  range_encoder.encode_bit( state_models[state()].match[pos_state], 1 );
+  range_encoder.encode_bit( state_models[state()].rep, 0 );
   encode_pair( 0xFFFFFFFFU, min_match_len, pos_state );
   range_encoder.flush();
   File_trailer trailer;
@@ -517,20 +617,41 @@ void LZ_encoder::full_flush( const State & state )
   for( int i = 0; i < File_trailer::size(); ++i )
     range_encoder.put_byte( trailer.data[i] );
   range_encoder.flush_data();
+  member_finished_ = true;
   }
 
 
 LZ_encoder::LZ_encoder( Matchfinder & mf, const File_header & header,
-                        const int outfd )
+                        const int outfd, Mem_writer * const mw )
+  :
+  longest_match_found( 0 ),
+  crc_( 0xFFFFFFFFU ),
+  matchfinder( mf ),
+  range_encoder( outfd, mw ),
+  len_encoder( matchfinder.match_len_limit() ),
+  rep_match_len_encoder( matchfinder.match_len_limit() ),
+  num_dis_slots( 2 * real_bits( matchfinder.dictionary_size() - 1 ) )
+  { init( header ); }
+
+
+LZ_encoder::LZ_encoder( Matchfinder & mf, const File_header & header,
+                        Mem_writer & mw )
   :
   longest_match_found( 0 ),
   crc_( 0xFFFFFFFFU ),
   matchfinder( mf ),
-  range_encoder( outfd ),
+  range_encoder( -1, &mw, true ),
   len_encoder( matchfinder.match_len_limit() ),
   rep_match_len_encoder( matchfinder.match_len_limit() ),
   num_dis_slots( 2 * real_bits( matchfinder.dictionary_size() - 1 ) )
+  { init( header ); }
+
+
+void LZ_encoder::init( const File_header & header )
   {
+  fill_counter = 0;
+  for( int i = 0; i < num_rep_distances; ++i ) rep_distances[i] = 0;
+  member_finished_ = false;
   fill_align_prices();
 
   for( int i = 0; i < File_header::size; ++i )
@@ -543,20 +664,15 @@ bool LZ_encoder::encode_member( const long long member_size )
   const long long member_size_limit =
     member_size - File_trailer::size() - max_marker_size;
   const int fill_count = ( matchfinder.match_len_limit() > 12 ) ? 512 : 2048;
-  int fill_counter = 0;
-  int rep_distances[num_rep_distances];
-  State state;
-  for( int i = 0; i < num_rep_distances; ++i ) rep_distances[i] = 0;
 
-  if( matchfinder.data_position() != 0 ||
-      range_encoder.member_position() != File_header::size )
-    return false;			// can be called only once
+  if( member_finished_ ) return false;
+  if( !matchfinder.enough_available_bytes() ) return true;
 
-  if( !matchfinder.finished() )		// encode first byte
-    {
+  if( matchfinder.data_position() == 0 && !matchfinder.finished() )
+    {					// encode first byte
     const uint8_t prev_byte = 0;
     const uint8_t cur_byte = matchfinder[0];
-    range_encoder.encode_bit( bm_match[state()][0], 0 );
+    range_encoder.encode_bit( state_models[state()].match[0], 0 );
     literal_encoder.encode( range_encoder, prev_byte, cur_byte );
     crc32.update( crc_, cur_byte );
     move_pos( 1 );
@@ -565,6 +681,8 @@ bool LZ_encoder::encode_member( const long long member_size )
   while( true )
     {
     if( matchfinder.finished() ) { full_flush( state ); return true; }
+    if( !matchfinder.enough_available_bytes() ||
+        !range_encoder.enough_free_bytes() ) return true;
     if( fill_counter <= 0 )
       { fill_distance_prices(); fill_counter = fill_count; }
 
@@ -580,7 +698,7 @@ bool LZ_encoder::encode_member( const long long member_size )
       const int len = trials[i].price;
 
       bool bit = ( dis < 0 && len == 1 );
-      range_encoder.encode_bit( bm_match[state()][pos_state], !bit );
+      range_encoder.encode_bit( state_models[state()].match[pos_state], !bit );
       if( bit )				// literal byte
         {
         const uint8_t prev_byte = matchfinder[-ahead-1];
@@ -601,18 +719,19 @@ bool LZ_encoder::encode_member( const long long member_size )
         crc32.update( crc_, matchfinder.ptr_to_current_pos() - ahead, len );
         mtf_reps( dis, rep_distances );
         bit = ( dis < num_rep_distances );
-        range_encoder.encode_bit( bm_rep[state()], bit );
+        range_encoder.encode_bit( state_models[state()].rep, bit );
         if( bit )
           {
           bit = ( dis == 0 );
-          range_encoder.encode_bit( bm_rep0[state()], !bit );
+          range_encoder.encode_bit( state_models[state()].rep0, !bit );
           if( bit )
-            range_encoder.encode_bit( bm_len[state()][pos_state], len > 1 );
+            range_encoder.encode_bit( state_models[state()].len[pos_state],
+                                      len > 1 );
           else
             {
-            range_encoder.encode_bit( bm_rep1[state()], dis > 1 );
+            range_encoder.encode_bit( state_models[state()].rep1, dis > 1 );
             if( dis > 1 )
-              range_encoder.encode_bit( bm_rep2[state()], dis > 2 );
+              range_encoder.encode_bit( state_models[state()].rep2, dis > 2 );
             }
           if( len == 1 ) state.set_short_rep();
           else
@@ -15,6 +15,19 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// If LONG_MATCH_INSERTS is defined to n > 0, only the first n positions
+// covered by a match are added to the dictionary. It skips most of the
+// tree maintenance inside very long matches at a small cost in ratio.
+#ifndef LONG_MATCH_INSERTS
+#define LONG_MATCH_INSERTS 0
+#endif
+
+// If WORD_MATCH_LEN is defined to 0, 'match_len' compares one byte at a
+// time. Only useful for measuring the effect of comparing words.
+#ifndef WORD_MATCH_LEN
+#define WORD_MATCH_LEN 1
+#endif
+
 enum { max_num_trials = 1 << 12,
        price_shift = 6 };
 
@@ -23,7 +36,7 @@ class Dis_slots
   unsigned char data[1<<12];
 
 public:
-  void init() throw()
+  Dis_slots() throw()
     {
     for( int slot = 0; slot < 4; ++slot ) data[slot] = slot;
     for( int i = 4, size = 2, slot = 4; slot < 24; slot += 2 )
@@ -53,7 +66,7 @@ class Prob_prices
   int data[bit_model_total >> 2];
 
 public:
-  void init() throw()
+  Prob_prices() throw()
     {
     const int num_bits = ( bit_model_total_bits - 2 );
     int j = 1, end = 2;
@@ -140,37 +153,88 @@ inline int price_matched( const Bit_model bm[], const int symbol,
   }
 
 
+// Returns the position of the first nonzero byte of 'x' as stored in
+// memory.
+inline int first_nonzero_byte( const uint64_t x ) throw()
+  {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return __builtin_clzll( x ) >> 3;
+#else
+  return __builtin_ctzll( x ) >> 3;
+#endif
+  }
+
+
+// Returns the number of equal bytes at the start of 'p1' and 'p2', up to
+// 'limit'. Compares 8 bytes at a time, the last 8 overlapping the ones
+// before if 'limit' is not a multiple of 8. 'p1' and 'p2' may overlap.
+inline int match_len( const uint8_t * const p1, const uint8_t * const p2,
+                      const int limit ) throw()
+  {
+  uint64_t w1, w2;
+  if( limit < 8 || !WORD_MATCH_LEN )
+    {
+    int len = 0;
+    while( len < limit && p1[len] == p2[len] ) ++len;
+    return len;
+    }
+  for( int len = 0; len < limit - 8; len += 8 )
+    {
+    memcpy( &w1, p1 + len, 8 );
+    memcpy( &w2, p2 + len, 8 );
+    if( w1 != w2 ) return len + first_nonzero_byte( w1 ^ w2 );
+    }
+  memcpy( &w1, p1 + limit - 8, 8 );
+  memcpy( &w2, p2 + limit - 8, 8 );
+  if( w1 != w2 ) return limit - 8 + first_nonzero_byte( w1 ^ w2 );
+  return limit;
+  }
+
+
 class Matchfinder
   {
   enum { // bytes to keep in buffer before dictionary
          before_size = max_num_trials + 1,
-         // bytes to keep in buffer after pos
-         after_size = max_match_len,
-         num_prev_positions4 = 1 << 20,
-         num_prev_positions3 = 1 << 18,
-         num_prev_positions2 = 1 << 16,
-         num_prev_positions = num_prev_positions4 + num_prev_positions3 +
-                              num_prev_positions2 };
+         // bytes to keep in buffer after pos; enough for a whole
+         // call to sequence_optimizer
+         after_size = max_num_trials + max_match_len,
+         max_prev_positions4 = 1 << 20,
+         max_prev_positions3 = 1 << 18,
+         max_prev_positions2 = 1 << 16,
+         min_prev_positions = 1 << 12 };
 
   long long partial_data_pos;
   uint8_t * buffer;		// input buffer
-  int32_t * const prev_positions;	// last seen position of key
+  int32_t * prev_positions;	// last seen position of key
+  int num_prev_positions4;	// sizes of the 3 parts of prev_positions,
+  int num_prev_positions3;	// scaled to the dictionary size
+  int num_prev_positions2;
+  int num_prev_positions;
+  bool exact_keys;		// key2 and key3 tell their bytes apart
   int32_t * prev_pos_tree;
   int dictionary_size_;		// bytes to keep in buffer before pos
   int buffer_size;
   int pos;			// current pos in buffer
+  int pos_offset;		// added to pos in prev_positions and tree
   int cyclic_pos;		// current pos in dictionary
   int stream_pos;		// first byte not yet read from file
   int pos_limit;		// when reached, a new block must be read
   const int match_len_limit_;
   const int cycles;
   const int infd;		// input file descriptor
+  Mem_reader * const mem_reader;	// used instead of infd if not null
   bool at_stream_end;		// stream_pos shows real end of file
 
   bool read_block();
+  void init_tables();
+  template< bool find_distances >
+  int find_matches( int * const distances ) throw();
 
 public:
-  Matchfinder( const int dict_size, const int len_limit, const int ifd );
+  Matchfinder( const int dict_size, const int len_limit, const int ifd,
+               Mem_reader * const mr = 0 );
+       // push mode. Data is supplied by the caller through 'write_data'
+  Matchfinder( const int dict_size, const int len_limit );
 
   ~Matchfinder()
     { delete[] prev_pos_tree; delete[] prev_positions; free( buffer ); }
@@ -183,6 +247,12 @@ public:
   int match_len_limit() const throw() { return match_len_limit_; }
   const uint8_t * ptr_to_current_pos() const throw() { return buffer + pos; }
 
+  bool enough_available_bytes() const throw()
+    { return ( stream_pos - pos >= after_size || at_stream_end ); }
+
+  void finish() throw() { at_stream_end = true; }
+  int write_data( const uint8_t * const inbuf, const int size ) throw();
+
   bool dec_pos( const int ahead ) throw()
     {
     if( ahead < 0 || pos < ahead ) return false;
@@ -197,14 +267,13 @@ public:
     if( index + len_limit > available_bytes() )
       len_limit = available_bytes() - index;
     const uint8_t * const data = buffer + pos + index - distance;
-    int i = 0;
-    while( i < len_limit && data[i] == data[i+distance] ) ++i;
-    return i;
+    return match_len( data, data + distance, len_limit );
     }
 
   void reset();
   void move_pos();
-  int longest_match_len( int * const distances = 0 ) throw();
+  int longest_match_len( int * const distances ) throw();
+  void skip_pos() throw();
   };
 
 
@@ -218,6 +287,8 @@ class Range_encoder
   uint32_t range;
   int ff_count;
   const int outfd;		// output file descriptor
+  Mem_writer * const mem_writer;	// used instead of outfd if not null
+  const bool user_reads;	// mem_writer is drained by the caller
   uint8_t cache;
 
   void shift_low()
@@ -234,7 +305,8 @@ class Range_encoder
     }
 
 public:
-  Range_encoder( const int ofd )
+  Range_encoder( const int ofd, Mem_writer * const mw = 0,
+                 const bool ureads = false )
     :
     low( 0 ),
     partial_member_pos( 0 ),
@@ -243,6 +315,8 @@ public:
     range( 0xFFFFFFFFU ),
     ff_count( 0 ),
     outfd( ofd ),
+    mem_writer( mw ),
+    user_reads( ureads ),
     cache( 0 ) {}
 
   ~Range_encoder() { delete[] buffer; }
@@ -250,6 +324,9 @@ public:
   long long member_position() const throw()
     { return partial_member_pos + pos + ff_count; }
 
+  bool enough_free_bytes() const throw()
+    { return !user_reads || mem_writer->unread() < buffer_size; }
+
   void flush() { for( int i = 0; i < 5; ++i ) shift_low(); }
   void flush_data();
 
@@ -427,13 +504,12 @@ class LZ_encoder
 
   int longest_match_found;
   uint32_t crc_;
+  int fill_counter;
+  int rep_distances[num_rep_distances];
+  State state;
+  bool member_finished_;
 
-  Bit_model bm_match[State::states][pos_states];
-  Bit_model bm_rep[State::states];
-  Bit_model bm_rep0[State::states];
-  Bit_model bm_rep1[State::states];
-  Bit_model bm_rep2[State::states];
-  Bit_model bm_len[State::states][pos_states];
+  State_models state_models[State::states];
   Bit_model bm_dis_slot[max_dis_states][1<<dis_slot_bits];
   Bit_model bm_dis[modeled_distances-end_dis_model+1];
   Bit_model bm_align[dis_align_size];
@@ -476,21 +552,22 @@ class LZ_encoder
 
   int price_rep_len1( const State & state, const int pos_state ) const throw()
     {
-    return price0( bm_rep0[state()] ) + price0( bm_len[state()][pos_state] );
+    return price0( state_models[state()].rep0 ) +
+           price0( state_models[state()].len[pos_state] );
     }
 
   int price_rep( const int rep, const State & state,
                  const int pos_state ) const throw()
     {
-    if( rep == 0 ) return price0( bm_rep0[state()] ) +
-                          price1( bm_len[state()][pos_state] );
-    int price = price1( bm_rep0[state()] );
+    if( rep == 0 ) return price0( state_models[state()].rep0 ) +
+                          price1( state_models[state()].len[pos_state] );
+    int price = price1( state_models[state()].rep0 );
     if( rep == 1 )
-      price += price0( bm_rep1[state()] );
+      price += price0( state_models[state()].rep1 );
     else
       {
-      price += price1( bm_rep1[state()] );
-      price += price_bit( bm_rep2[state()], rep - 2 );
+      price += price1( state_models[state()].rep1 );
+      price += price_bit( state_models[state()].rep2, rep - 2 );
       }
     return price;
     }
@@ -544,12 +621,13 @@ class LZ_encoder
     return len;
     }
 
-  void move_pos( int n, bool skip = false )
+  void move_pos( const int n, bool skip = false )
     {
-    while( --n >= 0 )
+    for( int i = 0; i < n; ++i )
       {
       if( skip ) skip = false;
-      else matchfinder.longest_match_len();
+      else if( LONG_MATCH_INSERTS <= 0 || i < LONG_MATCH_INSERTS )
+        matchfinder.skip_pos();
       matchfinder.move_pos();
       }
     }
@@ -571,11 +649,16 @@ class LZ_encoder
                           const State & state );
 
   void full_flush( const State & state );
+  void init( const File_header & header );
 
 public:
-  LZ_encoder( Matchfinder & mf, const File_header & header, const int outfd );
+  LZ_encoder( Matchfinder & mf, const File_header & header, const int outfd,
+              Mem_writer * const mw = 0 );
+       // push mode. The caller drains the output from 'mw'
+  LZ_encoder( Matchfinder & mf, const File_header & header, Mem_writer & mw );
 
   bool encode_member( const long long member_size );
+  bool member_finished() const throw() { return member_finished_; }
 
   long long member_position() const throw()
     { return range_encoder.member_position(); }
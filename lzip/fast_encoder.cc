@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <new>
 
 #include "lzip.h"
 #include "encoder.h"
@@ -31,40 +33,46 @@
 
 bool Fmatchfinder::read_block()
   {
-  if( !at_stream_end && stream_pos < buffer_size )
+  if( ( infd >= 0 || mem_reader ) &&
+      !at_stream_end && stream_pos < buffer_size )
     {
     const int size = buffer_size - stream_pos;
-    const int rd = readblock( infd, buffer + stream_pos, size );
+    const int rd = mem_reader ? mem_reader->read( buffer + stream_pos, size ) :
+                                readblock( infd, buffer + stream_pos, size );
     stream_pos += rd;
-    if( rd != size && errno ) throw Error( "Read error" );
+    if( rd != size && !mem_reader && errno ) throw Error( "Read error" );
     at_stream_end = ( rd < size );
     }
   return pos < stream_pos;
   }
 
 
-Fmatchfinder::Fmatchfinder( const int ifd )
+Fmatchfinder::Fmatchfinder( const int ifd, Mem_reader * const mr )
   :
   partial_data_pos( 0 ),
   prev_positions( new int32_t[num_prev_positions] ),
   pos( 0 ),
+  pos_offset( 0 ),
   cyclic_pos( 0 ),
   key4( 0 ),
   stream_pos( 0 ),
   match_len_limit_( 16 ),
   infd( ifd ),
+  mem_reader( mr ),
   at_stream_end( false )
   {
   const int dict_size = 65536;
   const int buffer_size_limit = ( 16 * dict_size ) + before_size + after_size;
   buffer_size = dict_size;
   buffer = (uint8_t *)malloc( buffer_size );
-  if( !buffer ) exit(-1);
+  if( !buffer ) { delete[] prev_positions; throw std::bad_alloc(); }
   if( read_block() && !at_stream_end && buffer_size < buffer_size_limit )
     {
+    uint8_t * const tmp = (uint8_t *)realloc( buffer, buffer_size_limit );
+    if( !tmp )
+      { free( buffer ); delete[] prev_positions; throw std::bad_alloc(); }
+    buffer = tmp;
     buffer_size = buffer_size_limit;
-    buffer = (uint8_t *)realloc( buffer, buffer_size );
-    if( !buffer ) exit(-1);
     read_block();
     }
   if( at_stream_end && stream_pos < dict_size )
@@ -72,21 +80,74 @@ Fmatchfinder::Fmatchfinder( const int ifd )
   else dictionary_size_ = dict_size;
   pos_limit = buffer_size;
   if( !at_stream_end ) pos_limit -= after_size;
-  prev_pos_chain = new int32_t[dictionary_size_];
+  init_tables();
+  }
+
+
+Fmatchfinder::Fmatchfinder()
+  :
+  partial_data_pos( 0 ),
+  prev_positions( new int32_t[num_prev_positions] ),
+  pos( 0 ),
+  pos_offset( 0 ),
+  cyclic_pos( 0 ),
+  key4( 0 ),
+  stream_pos( 0 ),
+  match_len_limit_( 16 ),
+  infd( -1 ),
+  mem_reader( 0 ),
+  at_stream_end( false )
+  {
+  const int dict_size = 65536;
+  buffer_size = ( 16 * dict_size ) + before_size + after_size;
+  buffer = (uint8_t *)malloc( buffer_size );
+  if( !buffer ) { delete[] prev_positions; throw std::bad_alloc(); }
+  dictionary_size_ = dict_size;
+  pos_limit = buffer_size - after_size;
+  init_tables();
+  }
+
+
+void Fmatchfinder::init_tables()
+  {
+  prev_pos_chain = new( std::nothrow ) int32_t[dictionary_size_];
+  if( !prev_pos_chain )
+    { free( buffer ); delete[] prev_positions; throw std::bad_alloc(); }
   for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = -1;
   }
 
 
+int Fmatchfinder::write_data( const uint8_t * const inbuf, const int size )
+  {
+  const int sz = min( buffer_size - stream_pos, size );
+  if( !at_stream_end && sz > 0 )
+    {
+    memcpy( buffer + stream_pos, inbuf, sz );
+    stream_pos += sz;
+    return sz;
+    }
+  return 0;
+  }
+
+
 void Fmatchfinder::reset()
   {
   const int size = stream_pos - pos;
   if( size > 0 ) memmove( buffer, buffer + pos, size );
   partial_data_pos = 0;
+  // Moving the positions a dictionary past the old ones makes the tables
+  // look empty without clearing them.
+  const int skip = stream_pos + dictionary_size_;
+  if( pos_offset <= INT_MAX - buffer_size - skip ) pos_offset += skip;
+  else
+    {
+    pos_offset = 0;
+    for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = -1;
+    }
   stream_pos -= pos;
   pos = 0;
   cyclic_pos = 0;
   key4 = 0;
-  for( int i = 0; i < num_prev_positions; ++i ) prev_positions[i] = -1;
   read_block();
   }
 
@@ -97,7 +158,7 @@ void Fmatchfinder::move_pos()
   if( ++pos >= pos_limit )
     {
     if( pos > stream_pos )
-      internal_error( "pos > stream_pos in Fmatchfinder::move_pos" );
+      throw Error( "internal error: pos > stream_pos in Fmatchfinder::move_pos" );
     if( !at_stream_end )
       {
       const int offset = pos - dictionary_size_ - before_size;
@@ -106,10 +167,17 @@ void Fmatchfinder::move_pos()
       partial_data_pos += offset;
       pos -= offset;
       stream_pos -= offset;
-      for( int i = 0; i < num_prev_positions; ++i )
-        if( prev_positions[i] >= 0 ) prev_positions[i] -= offset;
-      for( int i = 0; i < dictionary_size_; ++i )
-        if( prev_pos_chain[i] >= 0 ) prev_pos_chain[i] -= offset;
+      // The tables keep their positions until they could overflow.
+      if( pos_offset <= INT_MAX - buffer_size - offset ) pos_offset += offset;
+      else
+        {
+        const int d = pos_offset + offset;
+        for( int i = 0; i < num_prev_positions; ++i )
+          if( prev_positions[i] >= 0 ) prev_positions[i] -= d;
+        for( int i = 0; i < dictionary_size_; ++i )
+          if( prev_pos_chain[i] >= 0 ) prev_pos_chain[i] -= d;
+        pos_offset = 0;
+        }
       read_block();
       }
     }
@@ -126,24 +194,25 @@ int Fmatchfinder::longest_match_len( int * const distance )
     }
 
   const uint8_t * const data = buffer + pos;
+  const int tpos = pos + pos_offset;		// pos as kept in the tables
   key4 = ( ( key4 << 4 ) ^ data[3] ) & ( num_prev_positions - 1 );
 
   int newpos = prev_positions[key4];
-  prev_positions[key4] = pos;
+  prev_positions[key4] = tpos;
 
   int32_t * ptr0 = prev_pos_chain + cyclic_pos;
   int maxlen = 0;
 
   for( int count = 4; ; )
     {
-    if( newpos < (pos - dictionary_size_ + 1) || newpos < 0 || --count < 0 )
+    if( newpos < (tpos - dictionary_size_ + 1) || newpos < 0 || --count < 0 )
       { *ptr0 = -1; break; }
-    const uint8_t * const newdata = buffer + newpos;
+    const int delta = tpos - newpos;
+    const uint8_t * const newdata = data - delta;
     int len = 0;
     if( newdata[maxlen] == data[maxlen] )
-      while( len < len_limit && newdata[len] == data[len] ) ++len;
+      len = match_len( newdata, data, len_limit );
 
-    const int delta = pos - newpos;
     if( maxlen < len ) { maxlen = len; *distance = delta - 1; }
 
     int32_t * const newptr = prev_pos_chain +
@@ -176,22 +245,23 @@ void Fmatchfinder::longest_match_len()
     }
 
   const uint8_t * const data = buffer + pos;
+  const int tpos = pos + pos_offset;		// pos as kept in the tables
   key4 = ( ( key4 << 4 ) ^ data[3] ) & ( num_prev_positions - 1 );
 
   const int newpos = prev_positions[key4];
-  prev_positions[key4] = pos;
+  prev_positions[key4] = tpos;
 
   int32_t * const ptr0 = prev_pos_chain + cyclic_pos;
 
-  if( newpos < (pos - dictionary_size_ + 1) || newpos < 0 ) *ptr0 = -1;
+  if( newpos < (tpos - dictionary_size_ + 1) || newpos < 0 ) *ptr0 = -1;
   else
     {
-    const uint8_t * const newdata = buffer + newpos;
+    const uint8_t * const newdata = data - ( tpos - newpos );
     if( newdata[len_limit-1] != data[len_limit-1] ||
         memcmp( newdata, data, len_limit - 1 ) ) *ptr0 = newpos;
     else
       {
-      int idx = cyclic_pos - pos + newpos;
+      int idx = cyclic_pos - tpos + newpos;
       if( idx < 0 ) idx += dictionary_size_;
       *ptr0 = prev_pos_chain[idx];
       }
@@ -237,15 +307,16 @@ int FLZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
     {
     const uint8_t prev_byte = fmatchfinder[-1];
     const int pos_state = fmatchfinder.data_position() & pos_state_mask;
-    int price = price0( bm_match[state()][pos_state] );
+    int price = price0( state_models[state()].match[pos_state] );
     if( state.is_char() )
       price += literal_encoder.price_symbol( prev_byte, cur_byte );
     else
       price += literal_encoder.price_matched( prev_byte, cur_byte, match_byte );
-    const int short_rep_price = price1( bm_match[state()][pos_state] ) +
-                                price1( bm_rep[state()] ) +
-                                price0( bm_rep0[state()] ) +
-                                price0( bm_len[state()][pos_state] );
+    const State_models & models = state_models[state()];
+    const int short_rep_price = price1( models.match[pos_state] ) +
+                                price1( models.rep ) +
+                                price0( models.rep0 ) +
+                                price0( models.len[pos_state] );
     if( short_rep_price < price ) *disp = 0;
     }
 
@@ -258,8 +329,8 @@ int FLZ_encoder::sequence_optimizer( const int reps[num_rep_distances],
 void FLZ_encoder::full_flush( const State & state )
   {
   const int pos_state = fmatchfinder.data_position() & pos_state_mask;
-  range_encoder.encode_bit( bm_match[state()][pos_state], 1 );
-  range_encoder.encode_bit( bm_rep[state()], 0 );
+  range_encoder.encode_bit( state_models[state()].match[pos_state], 1 );
+  range_encoder.encode_bit( state_models[state()].rep, 0 );
   encode_pair( 0xFFFFFFFFU, min_match_len, pos_state );
   range_encoder.flush();
   File_trailer trailer;
@@ -269,19 +340,39 @@ void FLZ_encoder::full_flush( const State & state )
   for( int i = 0; i < File_trailer::size(); ++i )
     range_encoder.put_byte( trailer.data[i] );
   range_encoder.flush_data();
+  member_finished_ = true;
   }
 
 
 FLZ_encoder::FLZ_encoder( Fmatchfinder & mf, const File_header & header,
-                          const int outfd )
+                          const int outfd, Mem_writer * const mw )
   :
   crc_( 0xFFFFFFFFU ),
   fmatchfinder( mf ),
-  range_encoder( outfd ),
+  range_encoder( outfd, mw ),
   len_encoder( fmatchfinder.match_len_limit() ),
   rep_match_len_encoder( fmatchfinder.match_len_limit() ),
   num_dis_slots( 2 * real_bits( fmatchfinder.dictionary_size() - 1 ) )
+  { init( header ); }
+
+
+FLZ_encoder::FLZ_encoder( Fmatchfinder & mf, const File_header & header,
+                          Mem_writer & mw )
+  :
+  crc_( 0xFFFFFFFFU ),
+  fmatchfinder( mf ),
+  range_encoder( -1, &mw, true ),
+  len_encoder( fmatchfinder.match_len_limit() ),
+  rep_match_len_encoder( fmatchfinder.match_len_limit() ),
+  num_dis_slots( 2 * real_bits( fmatchfinder.dictionary_size() - 1 ) )
+  { init( header ); }
+
+
+void FLZ_encoder::init( const File_header & header )
   {
+  for( int i = 0; i < num_rep_distances; ++i ) rep_distances[i] = 0;
+  member_finished_ = false;
+
   for( int i = 0; i < File_header::size; ++i )
     range_encoder.put_byte( header.data[i] );
   }
@@ -291,19 +382,15 @@ bool FLZ_encoder::encode_member( const long long member_size )
   {
   const long long member_size_limit =
     member_size - File_trailer::size() - max_marker_size;
-  int rep_distances[num_rep_distances];
-  State state;
-  for( int i = 0; i < num_rep_distances; ++i ) rep_distances[i] = 0;
 
-  if( fmatchfinder.data_position() != 0 ||
-      range_encoder.member_position() != File_header::size )
-    return false;			// can be called only once
+  if( member_finished_ ) return false;
+  if( !fmatchfinder.enough_available_bytes() ) return true;
 
-  if( !fmatchfinder.finished() )		// encode first byte
-    {
+  if( fmatchfinder.data_position() == 0 && !fmatchfinder.finished() )
+    {					// encode first byte
     const uint8_t prev_byte = 0;
     const uint8_t cur_byte = fmatchfinder[0];
-    range_encoder.encode_bit( bm_match[state()][0], 0 );
+    range_encoder.encode_bit( state_models[state()].match[0], 0 );
     literal_encoder.encode( range_encoder, prev_byte, cur_byte );
     crc32.update( crc_, cur_byte );
     move_pos( 1 );
@@ -312,6 +399,8 @@ bool FLZ_encoder::encode_member( const long long member_size )
   while( true )
     {
     if( fmatchfinder.finished() ) { full_flush( state ); return true; }
+    if( !fmatchfinder.enough_available_bytes() ||
+        !range_encoder.enough_free_bytes() ) return true;
 
     const int pos_state = fmatchfinder.data_position() & pos_state_mask;
     int dis;
@@ -319,7 +408,7 @@ bool FLZ_encoder::encode_member( const long long member_size )
     if( len <= 0 ) return false;
 
     bool bit = ( dis < 0 && len == 1 );
-    range_encoder.encode_bit( bm_match[state()][pos_state], !bit );
+    range_encoder.encode_bit( state_models[state()].match[pos_state], !bit );
     if( bit )				// literal byte
       {
       const uint8_t prev_byte = fmatchfinder[-len-1];
@@ -340,18 +429,19 @@ bool FLZ_encoder::encode_member( const long long member_size )
       crc32.update( crc_, fmatchfinder.ptr_to_current_pos() - len, len );
       mtf_reps( dis, rep_distances );
       bit = ( dis < num_rep_distances );
-      range_encoder.encode_bit( bm_rep[state()], bit );
+      range_encoder.encode_bit( state_models[state()].rep, bit );
       if( bit )
         {
         bit = ( dis == 0 );
-        range_encoder.encode_bit( bm_rep0[state()], !bit );
+        range_encoder.encode_bit( state_models[state()].rep0, !bit );
         if( bit )
-          range_encoder.encode_bit( bm_len[state()][pos_state], len > 1 );
+          range_encoder.encode_bit( state_models[state()].len[pos_state],
+                                    len > 1 );
         else
           {
-          range_encoder.encode_bit( bm_rep1[state()], dis > 1 );
+          range_encoder.encode_bit( state_models[state()].rep1, dis > 1 );
           if( dis > 1 )
-            range_encoder.encode_bit( bm_rep2[state()], dis > 2 );
+            range_encoder.encode_bit( state_models[state()].rep2, dis > 2 );
           }
         if( len == 1 ) state.set_short_rep();
         else
@@ -19,8 +19,9 @@ class Fmatchfinder
   {
   enum { // bytes to keep in buffer before dictionary
          before_size = max_match_len + 1,
-         // bytes to keep in buffer after pos
-         after_size = max_match_len,
+         // bytes to keep in buffer after pos; enough for a whole
+         // call to sequence_optimizer
+         after_size = 2 * max_match_len,
          num_prev_positions = 1 << 16 };
 
   long long partial_data_pos;
@@ -30,18 +31,22 @@ class Fmatchfinder
   int dictionary_size_;		// bytes to keep in buffer before pos
   int buffer_size;
   int pos;			// current pos in buffer
+  int pos_offset;		// added to pos in prev_positions and chain
   int cyclic_pos;		// current pos in dictionary
   int key4;			// key made from latest 4 bytes
   int stream_pos;		// first byte not yet read from file
   int pos_limit;		// when reached, a new block must be read
   const int match_len_limit_;
   const int infd;		// input file descriptor
+  Mem_reader * const mem_reader;	// used instead of infd if not null
   bool at_stream_end;		// stream_pos shows real end of file
 
   bool read_block();
+  void init_tables();
 
 public:
-  Fmatchfinder( const int ifd );
+  Fmatchfinder( const int ifd, Mem_reader * const mr = 0 );
+  Fmatchfinder();			// push mode
 
   ~Fmatchfinder()
     { delete[] prev_pos_chain; delete[] prev_positions; free( buffer ); }
@@ -54,14 +59,18 @@ public:
   int match_len_limit() const { return match_len_limit_; }
   const uint8_t * ptr_to_current_pos() const { return buffer + pos; }
 
+  bool enough_available_bytes() const
+    { return ( stream_pos - pos >= after_size || at_stream_end ); }
+
+  void finish() { at_stream_end = true; }
+  int write_data( const uint8_t * const inbuf, const int size );
+
   int true_match_len( const int index, const int distance, int len_limit ) const
     {
     if( index + len_limit > available_bytes() )
       len_limit = available_bytes() - index;
     const uint8_t * const data = buffer + pos + index - distance;
-    int i = 0;
-    while( i < len_limit && data[i] == data[i+distance] ) ++i;
-    return i;
+    return match_len( data, data + distance, len_limit );
     }
 
   void reset();
@@ -77,13 +86,11 @@ class FLZ_encoder
          num_rep_distances = 4 };	// must be 4
 
   uint32_t crc_;
+  int rep_distances[num_rep_distances];
+  State state;
+  bool member_finished_;
 
-  Bit_model bm_match[State::states][pos_states];
-  Bit_model bm_rep[State::states];
-  Bit_model bm_rep0[State::states];
-  Bit_model bm_rep1[State::states];
-  Bit_model bm_rep2[State::states];
-  Bit_model bm_len[State::states][pos_states];
+  State_models state_models[State::states];
   Bit_model bm_dis_slot[max_dis_states][1<<dis_slot_bits];
   Bit_model bm_dis[modeled_distances-end_dis_model+1];
   Bit_model bm_align[dis_align_size];
@@ -160,11 +167,16 @@ class FLZ_encoder
                           int * const disp, const State & state );
 
   void full_flush( const State & state );
+  void init( const File_header & header );
 
 public:
-  FLZ_encoder( Fmatchfinder & mf, const File_header & header, const int outfd );
+  FLZ_encoder( Fmatchfinder & mf, const File_header & header, const int outfd,
+               Mem_writer * const mw = 0 );
+       // push mode. The caller drains the output from 'mw'
+  FLZ_encoder( Fmatchfinder & mf, const File_header & header, Mem_writer & mw );
 
   bool encode_member( const long long member_size );
+  bool member_finished() const { return member_finished_; }
 
   long long member_position() const
     { return range_encoder.member_position(); }
@@ -110,8 +110,24 @@ enum { bit_model_move_bits = 5,
 
 struct Bit_model
   {
-  unsigned int probability;
+  uint16_t probability;		// 16 bits halve the size of the tables
   Bit_model() : probability( bit_model_total / 2 ) {}
+  };
+
+     // Returns 'size' models, starting at 'bm', to their initial state.
+inline void init_models( Bit_model * const bm, const int size )
+  { for( int i = 0; i < size; ++i ) bm[i] = Bit_model(); }
+
+     // The models selected by the state, kept together (24 bytes) so
+     // that those used for one symbol share a cache line.
+struct State_models
+  {
+  Bit_model match[pos_states];
+  Bit_model len[pos_states];		// short rep or rep0 match
+  Bit_model rep;
+  Bit_model rep0;
+  Bit_model rep1;
+  Bit_model rep2;
   };
 
 
@@ -250,6 +266,68 @@ struct Error
   };
 
 
+// Input data held in memory, read block by block like a file descriptor.
+class Mem_reader
+  {
+  const uint8_t * data;
+  long long rest;
+
+public:
+  Mem_reader( const uint8_t * const buf, const long long size )
+    : data( buf ), rest( size ) {}
+
+  int read( uint8_t * const buf, const int size )
+    {
+    const int n = ( rest < size ) ? rest : size;
+    if( n > 0 ) { memcpy( buf, data, n ); data += n; rest -= n; }
+    return n;
+    }
+
+       // direct access, used to decode the data in place
+  const uint8_t * ptr() const { return data; }
+  long long available() const { return rest; }
+  void skip( const long long n ) { data += n; rest -= n; }
+  };
+
+
+// Growable output buffer. Memory is kept across calls to 'reset'.
+// Data can be consumed incrementally with 'read'.
+class Mem_writer
+  {
+  uint8_t * data_;
+  long long size_;
+  long long capacity;
+  long long read_pos;		// first byte not yet returned by read
+
+  Mem_writer( const Mem_writer & );		// declared as private
+  void operator=( const Mem_writer & );	// declared as private
+
+public:
+  Mem_writer() : data_( 0 ), size_( 0 ), capacity( 0 ), read_pos( 0 ) {}
+  ~Mem_writer() { free( data_ ); }
+
+  const uint8_t * data() const { return data_; }
+  long long size() const { return size_; }
+  long long unread() const { return size_ - read_pos; }
+  void reset() { size_ = 0; read_pos = 0; }
+  void write( const uint8_t * const buf, const int size );
+
+       // Returns room for 'size' more bytes, to be filled by the caller
+       // and then added to the data with 'commit'. Never returns a null
+       // pointer; a negative 'size' throws Error.
+  uint8_t * reserve( const long long size );
+  void commit( const long long size ) { size_ += size; }
+
+  int read( uint8_t * const buf, const int size )
+    {
+    const int n = ( unread() < size ) ? unread() : size;
+    if( n > 0 ) { memcpy( buf, data_ + read_pos, n ); read_pos += n; }
+    if( read_pos >= size_ ) reset();
+    return n;
+    }
+  };
+
+
 // defined in main.cc lziprecover.cc
 void show_error( const char * const msg, const int errcode = 0,
                  const bool help = false );
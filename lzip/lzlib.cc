@@ -0,0 +1,637 @@
+/*  Lzip - Data compressor based on the LZMA algorithm
+    Copyright (C) 2008, 2009, 2010, 2011 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+#include "lzlib.h"
+#include "lzip.h"
+#include "decoder.h"
+
+#if !DECODER_ONLY
+#include "encoder.h"
+#include "fast_encoder.h"
+#endif
+
+
+struct LZ_Encoder
+  {
+  const int dictionary_size;
+  const int match_len_limit;
+  const long long member_size;
+  const bool fast;
+  LZ_Errno lz_errno;
+  Mem_writer writer;
+  Mem_writer stream_writer;	// streaming output not yet read
+#if !DECODER_ONLY
+  Matchfinder * matchfinder;	// streaming state
+  LZ_encoder * lz_encoder;	// encoder of current member
+  Fmatchfinder * fmatchfinder;
+  FLZ_encoder * flz_encoder;
+#endif
+  bool stream_finished;
+  bool fatal;			// stream can't continue until reset
+
+  LZ_Encoder( const int dict_size, const int len_limit, const long long msize )
+    :
+    dictionary_size( dict_size ),
+    match_len_limit( len_limit ),
+    member_size( msize ),
+    fast( dict_size == 65535 && len_limit == 16 ),
+    lz_errno( LZ_ok ),
+#if !DECODER_ONLY
+    matchfinder( 0 ),
+    lz_encoder( 0 ),
+    fmatchfinder( 0 ),
+    flz_encoder( 0 ),
+#endif
+    stream_finished( false ),
+    fatal( false ) {}
+
+  ~LZ_Encoder() { reset(); }
+
+  void reset()
+    {
+#if !DECODER_ONLY
+    delete lz_encoder; lz_encoder = 0;
+    delete matchfinder; matchfinder = 0;
+    delete flz_encoder; flz_encoder = 0;
+    delete fmatchfinder; fmatchfinder = 0;
+#endif
+    stream_writer.reset();
+    stream_finished = false;
+    fatal = false;
+    }
+
+private:
+  LZ_Encoder( const LZ_Encoder & );		// declared as private
+  void operator=( const LZ_Encoder & );	// declared as private
+  };
+
+
+struct LZ_Decoder
+  {
+  LZ_Errno lz_errno;
+  Mem_writer writer;
+  Mem_reader reader;		// input of LZ_decompress_buffer
+  Range_decoder * buffer_rdec;
+  LZ_decoder * buffer_decoder;	// kept, with its window, across calls
+  Range_decoder * rdec;		// streaming state
+  LZ_decoder * lz_decoder;	// kept, with its window, across members
+  bool in_member;		// lz_decoder is decoding a member
+  bool first_member;
+  bool member_finished;		// lz_decoder may still have output
+  bool stream_finished;
+  bool fatal;			// stream can't continue until reset
+  bool trusted;			// see LZ_decompress_trust_input
+
+  LZ_Decoder()
+    :
+    lz_errno( LZ_ok ),
+    reader( 0, 0 ),
+    buffer_rdec( 0 ),
+    buffer_decoder( 0 ),
+    rdec( 0 ),
+    lz_decoder( 0 ),
+    in_member( false ),
+    first_member( true ),
+    member_finished( false ),
+    stream_finished( false ),
+    fatal( false ),
+    trusted( false ) {}
+
+  ~LZ_Decoder()
+    {
+    delete lz_decoder; delete rdec;
+    delete buffer_decoder; delete buffer_rdec;
+    }
+
+       // The decoders and their windows are kept for the next stream.
+  void reset()
+    {
+    if( rdec ) rdec->reset();
+    in_member = false;
+    first_member = true;
+    member_finished = false;
+    stream_finished = false;
+    fatal = false;
+    lz_errno = LZ_ok;
+    }
+
+private:
+  LZ_Decoder( const LZ_Decoder & );		// declared as private
+  void operator=( const LZ_Decoder & );	// declared as private
+  };
+
+
+namespace {
+
+long long lz_error( LZ_Errno & lz_errno, const LZ_Errno code )
+  { lz_errno = code; return -1; }
+
+
+     // Reads the header of the next member from the stream and creates
+     // its decoder. Returns false if more input is needed. Unless at the
+     // end of the stream, a byte past the header is needed too, so that a
+     // header that ends the input given so far is not taken for the end.
+bool start_member( LZ_Decoder * const d )
+  {
+  Range_decoder & rdec = *d->rdec;
+  if( rdec.available_bytes() <= File_header::size && !rdec.at_end() )
+    return false;
+  File_header header;
+  int size;
+  rdec.reset_member_position();
+  for( size = 0; size < File_header::size && !rdec.finished(); ++size )
+    header.data[size] = rdec.get_byte();
+  if( rdec.finished() )				// End Of File
+    {
+    if( d->first_member )
+      { d->fatal = true; lz_error( d->lz_errno, LZ_unexpected_eof ); }
+    d->stream_finished = true;
+    return true;
+    }
+  if( !header.verify_magic() )
+    {
+    if( d->first_member )
+      { d->fatal = true; lz_error( d->lz_errno, LZ_header_error ); }
+    d->stream_finished = true;			// trailing garbage
+    return true;
+    }
+  if( !header.verify_version() ||
+      header.dictionary_size() < min_dictionary_size ||
+      header.dictionary_size() > max_dictionary_size )
+    { d->fatal = true; lz_error( d->lz_errno, LZ_header_error ); return true; }
+  if( d->lz_decoder ) d->lz_decoder->reset( header );
+  else d->lz_decoder = new LZ_decoder( header, rdec );
+  d->lz_decoder->trust_input( d->trusted );
+  d->in_member = true;
+  d->first_member = false;
+  return true;
+  }
+
+
+#if !DECODER_ONLY
+     // Creates the push-mode matchfinder of a new stream.
+void open_stream( LZ_Encoder * const e )
+  {
+  if( e->fast ) { if( !e->fmatchfinder ) e->fmatchfinder = new Fmatchfinder; }
+  else if( !e->matchfinder )
+    e->matchfinder = new Matchfinder( e->dictionary_size, e->match_len_limit );
+  }
+
+
+     // Feeds input to 'mf' and runs 'enc' until more input or more output
+     // space is needed. Works for both the normal and the fast encoder.
+template< class MF, class ENC >
+int compress_stream( LZ_Encoder * const e, MF & mf, ENC *& enc,
+                     const uint8_t * const inbuf, const int insize, int & in,
+                     uint8_t * const outbuf, const int outsize, int & out )
+  {
+  while( true )
+    {
+    in += mf.write_data( inbuf + in, insize - in );
+    out += e->stream_writer.read( outbuf + out, outsize - out );
+    if( e->stream_finished )
+      return e->stream_writer.unread() ? LZ_need_output : LZ_done;
+    if( !enc )
+      {
+      File_header header;
+      header.set_magic();
+      header.dictionary_size( mf.dictionary_size() );
+      enc = new ENC( mf, header, e->stream_writer );
+      }
+    if( enc->member_finished() )
+      {
+      delete enc; enc = 0;
+      if( mf.finished() ) e->stream_finished = true;
+      else mf.reset();
+      continue;
+      }
+    if( !enc->encode_member( e->member_size ) )
+      { e->fatal = true; lz_error( e->lz_errno, LZ_library_error ); return -1; }
+    if( enc->member_finished() ) continue;
+    if( !mf.enough_available_bytes() )
+      { if( in < insize ) continue; return LZ_need_input; }
+    if( out < outsize ) continue;
+    return LZ_need_output;
+    }
+  }
+#endif
+
+} // end namespace
+
+
+const char * LZ_version( void ) { return PROGVERSION; }
+
+
+const char * LZ_strerror( const LZ_Errno lz_errno )
+  {
+  switch( lz_errno )
+    {
+    case LZ_ok            : return "ok";
+    case LZ_bad_argument  : return "Bad argument";
+    case LZ_mem_error     : return "Not enough memory";
+    case LZ_sequence_error: return "Sequence error";
+    case LZ_header_error  : return "Header error";
+    case LZ_unexpected_eof: return "Unexpected eof";
+    case LZ_data_error    : return "Data error";
+    case LZ_library_error : return "Library error";
+    }
+  return "Invalid error code";
+  }
+
+
+int LZ_min_dictionary_size( void ) { return min_dictionary_size; }
+int LZ_max_dictionary_size( void ) { return max_dictionary_size; }
+
+
+LZ_Encoder * LZ_compress_open( const int dictionary_size,
+                               const int match_len_limit,
+                               const long long member_size )
+  {
+  LZ_Encoder * const encoder = new( std::nothrow )
+    LZ_Encoder( dictionary_size, match_len_limit, member_size );
+  if( !encoder ) return 0;
+  File_header header;
+  if( ( !encoder->fast &&
+        ( !header.dictionary_size( dictionary_size ) ||
+          match_len_limit < min_match_len_limit ||
+          match_len_limit > max_match_len ) ) ||
+      member_size < min_dictionary_size )
+    encoder->lz_errno = LZ_bad_argument;
+#if DECODER_ONLY
+  encoder->lz_errno = LZ_library_error;
+#endif
+  return encoder;
+  }
+
+
+int LZ_compress_close( LZ_Encoder * const encoder )
+  {
+  if( !encoder ) return -1;
+  delete encoder;
+  return 0;
+  }
+
+
+LZ_Errno LZ_compress_errno( LZ_Encoder * const encoder )
+  {
+  if( !encoder ) return LZ_bad_argument;
+  return encoder->lz_errno;
+  }
+
+
+long long LZ_compress_buffer( LZ_Encoder * const encoder,
+                              const uint8_t * const inbuf,
+                              const long long insize,
+                              const uint8_t ** const outbufp )
+  {
+  if( !encoder || encoder->lz_errno == LZ_bad_argument ||
+      encoder->lz_errno == LZ_library_error ) return -1;
+  if( insize < 0 || ( !inbuf && insize > 0 ) || !outbufp )
+    return lz_error( encoder->lz_errno, LZ_bad_argument );
+#if DECODER_ONLY
+  return lz_error( encoder->lz_errno, LZ_library_error );
+#else
+  encoder->writer.reset();
+  Mem_reader reader( inbuf, insize );
+  File_header header;
+  header.set_magic();
+  try {
+    if( encoder->fast )
+      {
+      Fmatchfinder fmatchfinder( -1, &reader );
+      header.dictionary_size( fmatchfinder.dictionary_size() );
+      while( true )		// encode one member per iteration
+        {
+        FLZ_encoder flz_encoder( fmatchfinder, header, -1, &encoder->writer );
+        if( !flz_encoder.encode_member( encoder->member_size ) )
+          return lz_error( encoder->lz_errno, LZ_library_error );
+        if( fmatchfinder.finished() ) break;
+        fmatchfinder.reset();
+        }
+      }
+    else
+      {
+      header.dictionary_size( encoder->dictionary_size );
+      Matchfinder matchfinder( header.dictionary_size(),
+                               encoder->match_len_limit, -1, &reader );
+      header.dictionary_size( matchfinder.dictionary_size() );
+      while( true )		// encode one member per iteration
+        {
+        LZ_encoder lz_encoder( matchfinder, header, -1, &encoder->writer );
+        if( !lz_encoder.encode_member( encoder->member_size ) )
+          return lz_error( encoder->lz_errno, LZ_library_error );
+        if( matchfinder.finished() ) break;
+        matchfinder.reset();
+        }
+      }
+    }
+  catch( std::bad_alloc & )
+    { return lz_error( encoder->lz_errno, LZ_mem_error ); }
+  catch( Error )
+    { return lz_error( encoder->lz_errno, LZ_library_error ); }
+  encoder->lz_errno = LZ_ok;
+  *outbufp = encoder->writer.data();
+  return encoder->writer.size();
+#endif
+  }
+
+
+int LZ_compress_stream( LZ_Encoder * const encoder,
+                        const uint8_t * const inbuf, int * const insizep,
+                        uint8_t * const outbuf, int * const outsizep )
+  {
+  if( !encoder || encoder->lz_errno == LZ_bad_argument ||
+      encoder->lz_errno == LZ_library_error || encoder->fatal ) return -1;
+  if( !insizep || !outsizep || *insizep < 0 || *outsizep < 0 ||
+      ( !inbuf && *insizep > 0 ) || ( !outbuf && *outsizep > 0 ) )
+    return lz_error( encoder->lz_errno, LZ_bad_argument );
+#if DECODER_ONLY
+  return lz_error( encoder->lz_errno, LZ_library_error );
+#else
+  const int insize = *insizep, outsize = *outsizep;
+  int in = 0, out = 0;
+  int status = -1;
+  try {
+    open_stream( encoder );
+    if( encoder->fast )
+      status = compress_stream( encoder, *encoder->fmatchfinder,
+                                encoder->flz_encoder, inbuf, insize, in,
+                                outbuf, outsize, out );
+    else
+      status = compress_stream( encoder, *encoder->matchfinder,
+                                encoder->lz_encoder, inbuf, insize, in,
+                                outbuf, outsize, out );
+    }
+  catch( std::bad_alloc & )
+    { encoder->fatal = true; lz_error( encoder->lz_errno, LZ_mem_error ); }
+  catch( Error )
+    { encoder->fatal = true; lz_error( encoder->lz_errno, LZ_library_error ); }
+  *insizep = in;
+  *outsizep = out;
+  if( encoder->fatal ) return -1;
+  encoder->lz_errno = LZ_ok;
+  return status;
+#endif
+  }
+
+
+int LZ_compress_finish( LZ_Encoder * const encoder )
+  {
+  if( !encoder || encoder->lz_errno == LZ_bad_argument ||
+      encoder->lz_errno == LZ_library_error || encoder->fatal ) return -1;
+#if DECODER_ONLY
+  return -1;
+#else
+  try { open_stream( encoder ); }
+  catch( std::bad_alloc & )
+    { lz_error( encoder->lz_errno, LZ_mem_error ); return -1; }
+  if( encoder->fast ) encoder->fmatchfinder->finish();
+  else encoder->matchfinder->finish();
+  return 0;
+#endif
+  }
+
+
+int LZ_compress_reset( LZ_Encoder * const encoder )
+  {
+  if( !encoder ) return -1;
+  encoder->reset();
+  if( encoder->lz_errno != LZ_bad_argument &&
+      encoder->lz_errno != LZ_library_error ) encoder->lz_errno = LZ_ok;
+  return 0;
+  }
+
+
+LZ_Decoder * LZ_decompress_open( void )
+  {
+  return new( std::nothrow ) LZ_Decoder;
+  }
+
+
+int LZ_decompress_close( LZ_Decoder * const decoder )
+  {
+  if( !decoder ) return -1;
+  delete decoder;
+  return 0;
+  }
+
+
+LZ_Errno LZ_decompress_errno( LZ_Decoder * const decoder )
+  {
+  if( !decoder ) return LZ_bad_argument;
+  return decoder->lz_errno;
+  }
+
+
+long long LZ_decompress_buffer( LZ_Decoder * const decoder,
+                                const uint8_t * const inbuf,
+                                const long long insize,
+                                const uint8_t ** const outbufp )
+  {
+  if( !decoder ) return -1;
+  if( insize < 0 || ( !inbuf && insize > 0 ) || !outbufp )
+    return lz_error( decoder->lz_errno, LZ_bad_argument );
+  decoder->writer.reset();
+  decoder->reader = Mem_reader( inbuf, insize );
+  try {
+    // If the sizes of all members are known, decode them straight into
+    // the output buffer (linear mode) instead of through a circular one.
+    // The sizes come from the trailers, so unless the input is trusted,
+    // they are reserved in advance only if plausible for 'insize'. Else
+    // the output grows as it is decoded.
+    const long long max_reserve_ratio = 64;
+    const long long min_reserve_limit = 1 << 24;
+    std::vector< Member_info > members;
+    long long total_size = 0;
+    const bool indexed = index_members( inbuf, insize, members );
+    if( indexed )
+      for( unsigned i = 0; i < members.size(); ++i )
+        total_size += members[i].data_size;
+    if( indexed &&
+        ( decoder->trusted || total_size <= min_reserve_limit ||
+          total_size / max_reserve_ratio <= insize ) )
+      {
+      uint8_t * const linear_buf = decoder->writer.reserve( total_size );
+      unsigned failed;
+      long long error_pos;
+      const int result = decode_members( inbuf, members, linear_buf,
+                                         decoder->trusted, failed, error_pos );
+      if( result != 0 )
+        return lz_error( decoder->lz_errno,
+                         ( result == 2 ) ? LZ_unexpected_eof : LZ_data_error );
+      decoder->writer.commit( total_size );
+      }
+    else
+      {
+      if( decoder->buffer_rdec ) decoder->buffer_rdec->reset();
+      else decoder->buffer_rdec = new Range_decoder( -1, &decoder->reader );
+      Range_decoder & rdec = *decoder->buffer_rdec;
+      for( unsigned i = 0; ; ++i )
+        {
+        const bool first_member = ( i == 0 );
+        File_header header;
+        int size;
+        rdec.reset_member_position();
+        for( size = 0; size < File_header::size && !rdec.finished(); ++size )
+          header.data[size] = rdec.get_byte();
+        if( rdec.finished() )			// End Of File
+          {
+          if( first_member )
+            return lz_error( decoder->lz_errno, LZ_unexpected_eof );
+          break;
+          }
+        if( !header.verify_magic() )
+          {
+          if( first_member )
+            return lz_error( decoder->lz_errno, LZ_header_error );
+          break;				// trailing garbage
+          }
+        if( !header.verify_version() ||
+            header.dictionary_size() < min_dictionary_size ||
+            header.dictionary_size() > max_dictionary_size )
+          return lz_error( decoder->lz_errno, LZ_header_error );
+
+        LZ_decoder *& lz_decoder = decoder->buffer_decoder;
+        if( lz_decoder ) lz_decoder->reset( header );
+        else lz_decoder = new LZ_decoder( header, rdec, -1, &decoder->writer );
+        lz_decoder->trust_input( decoder->trusted );
+        const int result = lz_decoder->decode_member();
+        if( result != 0 )
+          return lz_error( decoder->lz_errno,
+                           ( result == 2 ) ? LZ_unexpected_eof : LZ_data_error );
+        }
+      }
+    }
+  catch( std::bad_alloc & )
+    { return lz_error( decoder->lz_errno, LZ_mem_error ); }
+  catch( Error )
+    { return lz_error( decoder->lz_errno, LZ_library_error ); }
+  decoder->lz_errno = LZ_ok;
+  *outbufp = decoder->writer.data();
+  return decoder->writer.size();
+  }
+
+
+int LZ_decompress_stream( LZ_Decoder * const decoder,
+                          const uint8_t * const inbuf, int * const insizep,
+                          uint8_t * const outbuf, int * const outsizep )
+  {
+  if( !decoder ) return -1;
+  if( decoder->fatal ) return -1;
+  if( !insizep || !outsizep || *insizep < 0 || *outsizep < 0 ||
+      ( !inbuf && *insizep > 0 ) || ( !outbuf && *outsizep > 0 ) )
+    return lz_error( decoder->lz_errno, LZ_bad_argument );
+  const int insize = *insizep, outsize = *outsizep;
+  int in = 0, out = 0;
+  int status = LZ_need_input;
+  try {
+    if( !decoder->rdec ) decoder->rdec = new Range_decoder;
+    Range_decoder & rdec = *decoder->rdec;
+    while( true )
+      {
+      in += rdec.write_data( inbuf + in, insize - in );
+      if( decoder->in_member )
+        {
+        LZ_decoder & lz_decoder = *decoder->lz_decoder;
+        out += lz_decoder.read_data( outbuf + out, outsize - out );
+        if( decoder->member_finished )
+          {
+          if( lz_decoder.data_pending() ) { status = LZ_need_output; break; }
+          decoder->in_member = false;
+          decoder->member_finished = false;
+          continue;
+          }
+        const int result = lz_decoder.decode_member();
+        if( result == 0 ) { decoder->member_finished = true; continue; }
+        if( result == 5 )
+          { if( in < insize ) continue; status = LZ_need_input; break; }
+        if( result == 6 )
+          { if( out < outsize ) continue; status = LZ_need_output; break; }
+        decoder->fatal = true;
+        lz_error( decoder->lz_errno,
+                  ( result == 2 ) ? LZ_unexpected_eof : LZ_data_error );
+        break;
+        }
+      else if( decoder->stream_finished ) { status = LZ_done; break; }
+      else if( !start_member( decoder ) )
+        {
+        if( in < insize ) continue;
+        status = LZ_need_input; break;
+        }
+      else if( decoder->fatal ) break;
+      }
+    }
+  catch( std::bad_alloc & )
+    { decoder->fatal = true; lz_error( decoder->lz_errno, LZ_mem_error ); }
+  catch( Error )
+    { decoder->fatal = true; lz_error( decoder->lz_errno, LZ_library_error ); }
+  *insizep = in;
+  *outsizep = out;
+  if( decoder->fatal ) return -1;
+  decoder->lz_errno = LZ_ok;
+  return status;
+  }
+
+
+int LZ_decompress_finish( LZ_Decoder * const decoder )
+  {
+  if( !decoder ) return -1;
+  if( !decoder->rdec )
+    {
+    decoder->rdec = new( std::nothrow ) Range_decoder;
+    if( !decoder->rdec )
+      { lz_error( decoder->lz_errno, LZ_mem_error ); return -1; }
+    }
+  decoder->rdec->finish();
+  return 0;
+  }
+
+
+int LZ_decompress_peak_window_size( LZ_Decoder * const decoder )
+  {
+  if( !decoder ) return -1;
+  int size = 0;
+  if( decoder->lz_decoder ) size = decoder->lz_decoder->window_size();
+  if( decoder->buffer_decoder )
+    size = max( size, decoder->buffer_decoder->window_size() );
+  return size;
+  }
+
+
+int LZ_decompress_trust_input( LZ_Decoder * const decoder,
+                               const int trusted )
+  {
+  if( !decoder ) return -1;
+  decoder->trusted = ( trusted != 0 );
+  return 0;
+  }
+
+
+int LZ_decompress_reset( LZ_Decoder * const decoder )
+  {
+  if( !decoder ) return -1;
+  decoder->reset();
+  return 0;
+  }
@@ -0,0 +1,136 @@
+/*  Lzip - Data compressor based on the LZMA algorithm
+    Copyright (C) 2008, 2009, 2010, 2011 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    In-memory interface to the lzip compressor and decompressor.
+
+    All the state lives in the LZ_Encoder and LZ_Decoder objects, so
+    different objects can be used concurrently from different threads.
+    No function of this library writes to the standard streams or calls
+    exit; errors are reported through the return values and the
+    'LZ_*_errno' functions.
+*/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum LZ_Errno { LZ_ok = 0, LZ_bad_argument, LZ_mem_error,
+                LZ_sequence_error, LZ_header_error, LZ_unexpected_eof,
+                LZ_data_error, LZ_library_error };
+
+enum LZ_Status { LZ_need_input = 1, LZ_need_output, LZ_done };
+
+const char * LZ_version( void );
+const char * LZ_strerror( const enum LZ_Errno lz_errno );
+
+int LZ_min_dictionary_size( void );
+int LZ_max_dictionary_size( void );
+
+
+struct LZ_Encoder;
+
+/* Returns a new encoder, or 0 if not enough memory. Use
+   'LZ_compress_errno' to check for invalid arguments.
+   A dictionary_size of 65535 with a match_len_limit of 16 selects the
+   fast encoder used by option '-0'. */
+struct LZ_Encoder * LZ_compress_open( const int dictionary_size,
+                                      const int match_len_limit,
+                                      const long long member_size );
+int LZ_compress_close( struct LZ_Encoder * const encoder );
+enum LZ_Errno LZ_compress_errno( struct LZ_Encoder * const encoder );
+
+/* Compresses 'insize' bytes from 'inbuf' into a complete lzip stream.
+   Returns the size of the compressed data, or -1 in case of error.
+   On success '*outbufp' points to the compressed data, which is owned by
+   the encoder and remains valid until the next call or 'LZ_compress_close'. */
+long long LZ_compress_buffer( struct LZ_Encoder * const encoder,
+                              const uint8_t * const inbuf,
+                              const long long insize,
+                              const uint8_t ** const outbufp );
+
+/* Streaming interface. Each call to 'LZ_compress_stream' accepts up to
+   '*insizep' bytes from 'inbuf' and produces up to '*outsizep' bytes into
+   'outbuf', and then sets '*insizep' and '*outsizep' to the number of
+   bytes actually consumed and produced. It never blocks. Returns
+   LZ_need_input when more input is needed, LZ_need_output when 'outbuf'
+   is full, LZ_done after the last member has been encoded and read, or -1
+   in case of error. Compressed data is produced in blocks, and the last
+   block is only produced after 'LZ_compress_finish' has been called.
+   The dictionary size is never reduced to the size of the input, as the
+   latter is not known in advance. 'LZ_compress_reset' prepares the
+   encoder for a new stream. */
+int LZ_compress_stream( struct LZ_Encoder * const encoder,
+                        const uint8_t * const inbuf, int * const insizep,
+                        uint8_t * const outbuf, int * const outsizep );
+int LZ_compress_finish( struct LZ_Encoder * const encoder );
+int LZ_compress_reset( struct LZ_Encoder * const encoder );
+
+
+struct LZ_Decoder;
+
+struct LZ_Decoder * LZ_decompress_open( void );
+int LZ_decompress_close( struct LZ_Decoder * const decoder );
+enum LZ_Errno LZ_decompress_errno( struct LZ_Decoder * const decoder );
+
+/* Decompresses all the members contained in 'inbuf'. Trailing data
+   following the last member is ignored, as in the command line tool.
+   Returns the size of the decompressed data, or -1 in case of error.
+   The output is allocated at once from the sizes in the member trailers
+   if they are plausible for 'insize' (or the input is trusted), else as
+   it is decompressed. On success '*outbufp' points to the decompressed data, which is owned
+   by the decoder and remains valid until the next call or
+   'LZ_decompress_close'. */
+long long LZ_decompress_buffer( struct LZ_Decoder * const decoder,
+                                const uint8_t * const inbuf,
+                                const long long insize,
+                                const uint8_t ** const outbufp );
+
+/* Streaming interface. Each call to 'LZ_decompress_stream' accepts up to
+   '*insizep' bytes from 'inbuf' and produces up to '*outsizep' bytes into
+   'outbuf', and then sets '*insizep' and '*outsizep' to the number of
+   bytes actually consumed and produced. It never blocks. Returns
+   LZ_need_input when all the input given has been consumed, LZ_need_output
+   when 'outbuf' is full, LZ_done after the last member has been decoded
+   and read, or -1 in case of error. Call 'LZ_decompress_finish' after
+   the last input byte has been accepted. 'LZ_decompress_reset' prepares
+   the decoder for a new stream. */
+int LZ_decompress_stream( struct LZ_Decoder * const decoder,
+                          const uint8_t * const inbuf, int * const insizep,
+                          uint8_t * const outbuf, int * const outsizep );
+int LZ_decompress_finish( struct LZ_Decoder * const decoder );
+int LZ_decompress_reset( struct LZ_Decoder * const decoder );
+
+/* If 'trusted' is nonzero, the members decoded from now on are assumed to
+   be valid, and the decoder skips the validation of match distances
+   against the data decoded so far. Memory is still accessed safely, and
+   corrupt data is still reported, but as a CRC mismatch in the trailer
+   (LZ_data_error) instead of where it happens. Not changed by reset. */
+int LZ_decompress_trust_input( struct LZ_Decoder * const decoder,
+                               const int trusted );
+
+/* Returns the size of the largest window held by the decoder. Windows
+   start small and grow with the data decoded up to the dictionary size
+   of the member. They are kept for later members, calls and streams
+   (also across 'LZ_decompress_reset') until 'LZ_decompress_close'. No
+   window is allocated for members decoded straight into the output. */
+int LZ_decompress_peak_window_size( struct LZ_Decoder * const decoder );
+
+#ifdef __cplusplus
+}
+#endif
@@ -32,6 +32,9 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <utime.h>
+#include <new>
+#include <vector>
+#include <pthread.h>
 #include <sys/stat.h>
 #if defined(__MSVCRT__)
 #include <io.h>
@@ -47,6 +50,9 @@
 #if defined(__OS2__)
 #include <io.h>
 #endif
+#if !defined(__MSVCRT__) && !defined(__OS2__)
+#include <sys/mman.h>
+#endif
 
 #include "lzip.h"
 #include "decoder.h"
@@ -99,6 +105,8 @@ struct Lzma_options
 
 enum Mode { m_compress, m_decompress, m_test };
 
+enum { max_workers = 1024 };
+
 int outfd = -1;
 int verbosity = 0;
 bool delete_output_on_interrupt = false;
@@ -119,6 +127,7 @@ void show_help()
   printf( "  -F, --recompress           force recompression of compressed files\n" );
   printf( "  -k, --keep                 keep (don't delete) input files\n" );
   printf( "  -m, --match-length=<n>     set match length limit in bytes [36]\n" );
+  printf( "  -n, --threads=<n>          set the number of (de)compression threads [1]\n" );
   printf( "  -o, --output=<file>        if reading stdin, place the output into <file>\n" );
   printf( "  -q, --quiet                suppress all messages\n" );
   printf( "  -s, --dictionary-size=<n>  set dictionary size limit in bytes [8MiB]\n" );
@@ -228,7 +237,141 @@ bool next_filename()
   return false;
 }
 
+// Work done by a thread of a 'Worker_pool'. 'done' is set by the pool.
+class Task
+{
+public:
+  bool done;
+
+  Task() : done( false ) {}
+  virtual ~Task() {}
+  virtual void run() = 0;
+};
+
+
+extern "C" void * run_worker( void * const arg );
+
+// Threads running the tasks given to 'put', and the tasks not yet
+// deleted with 'delete_first', in the order given. The threads are stopped, and
+// the tasks deleted, by the destructor.
+class Worker_pool
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t task_added;	// or pool closed
+  pthread_cond_t task_done;
+  std::vector< Task * > tasks;
+  unsigned next;		// first task not yet started
+  bool closed;
+  std::vector< pthread_t > workers;
+
+  Worker_pool( const Worker_pool & );		// declared as private
+  void operator=( const Worker_pool & );	// declared as private
+
+  void close()
+  {
+    pthread_mutex_lock( &mutex );
+    closed = true;
+    pthread_cond_broadcast( &task_added );
+    pthread_mutex_unlock( &mutex );
+    for( unsigned i = 0; i < workers.size(); ++i )
+      pthread_join( workers[i], 0 );
+    for( unsigned i = 0; i < tasks.size(); ++i ) delete tasks[i];
+    pthread_cond_destroy( &task_done );
+    pthread_cond_destroy( &task_added );
+    pthread_mutex_destroy( &mutex );
+  }
+
+public:
+  explicit Worker_pool( const int num_workers ) : next( 0 ), closed( false )
+  {
+    pthread_mutex_init( &mutex, 0 );
+    pthread_cond_init( &task_added, 0 );
+    pthread_cond_init( &task_done, 0 );
+    for( int i = 0; i < num_workers; ++i )
+    {
+      pthread_t worker;
+      if( pthread_create( &worker, 0, run_worker, this ) != 0 )
+      { close(); throw Error( "Can't create worker threads" ); }
+      workers.push_back( worker );
+    }
+  }
+
+  ~Worker_pool() { close(); }
+
+  unsigned size() const { return tasks.size(); }
+
+  void put( Task * const task )
+  {
+    pthread_mutex_lock( &mutex );
+    tasks.push_back( task );
+    pthread_cond_signal( &task_added );
+    pthread_mutex_unlock( &mutex );
+  }
+
+       // Waits until the first task has been run, and returns it.
+  const Task & first()
+  {
+    pthread_mutex_lock( &mutex );
+    Task * const task = tasks.front();
+    while( !task->done ) pthread_cond_wait( &task_done, &mutex );
+    pthread_mutex_unlock( &mutex );
+    return *task;
+  }
+
+  void delete_first()
+  {
+    pthread_mutex_lock( &mutex );
+    delete tasks.front();
+    tasks.erase( tasks.begin() ); --next;
+    pthread_mutex_unlock( &mutex );
+  }
+
+       // Run by each thread until the pool is closed.
+  void work()
+  {
+    while( true )
+    {
+      pthread_mutex_lock( &mutex );
+      while( next >= tasks.size() && !closed )
+        pthread_cond_wait( &task_added, &mutex );
+      if( closed ) { pthread_mutex_unlock( &mutex ); break; }
+      Task * const task = tasks[next++];
+      pthread_mutex_unlock( &mutex );
+      task->run();
+      pthread_mutex_lock( &mutex );
+      task->done = true;
+      pthread_cond_broadcast( &task_done );
+      pthread_mutex_unlock( &mutex );
+    }
+  }
+};
+
+
+extern "C" void * run_worker( void * const arg )
+{
+  ( (Worker_pool *)arg )->work();
+  return 0;
+}
+
+
 #if !DECODER_ONLY
+void show_stats( const long long in_size, const long long out_size )
+{
+  if( verbosity >= 1 )
+  {
+    if( in_size <= 0 || out_size <= 0 )
+      fprintf( stderr, "No data compressed.\n" );
+    else
+      fprintf( stderr, "%6.3f:1, %6.3f bits/byte, "
+                            "%5.2f%% saved, %lld in, %lld out.\n",
+                    (double)in_size / out_size,
+                    ( 8.0 * out_size ) / in_size,
+                    100.0 * ( 1.0 - ( (double)out_size / in_size ) ),
+                    in_size, out_size );
+  }
+}
+
+
 int compress( const long long member_size, const long long volume_size,
               const Lzma_options & encoder_options, const int infd,
               const struct stat * const in_statsp )
@@ -240,7 +383,7 @@ int compress( const long long member_size, const long long volume_size,
       encoder_options.match_len_limit > max_match_len )
     internal_error( "invalid argument to encoder" );
   int retval = 0;
-
+  try {
     Matchfinder matchfinder( header.dictionary_size(),
                              encoder_options.match_len_limit, infd );
     header.dictionary_size( matchfinder.dictionary_size() );
@@ -272,18 +415,14 @@ int compress( const long long member_size, const long long volume_size,
       matchfinder.reset();
     }
 
-    if( retval == 0 && verbosity >= 1 )
-    {
-      if( in_size <= 0 || out_size <= 0 )
-        fprintf( stderr, "No data compressed.\n" );
-      else
-        fprintf( stderr, "%6.3f:1, %6.3f bits/byte, "
-                              "%5.2f%% saved, %lld in, %lld out.\n",
-                      (double)in_size / out_size,
-                      ( 8.0 * out_size ) / in_size,
-                      100.0 * ( 1.0 - ( (double)out_size / in_size ) ),
-                      in_size, out_size );
-    }
+    if( retval == 0 ) show_stats( in_size, out_size );
+  }
+  catch( std::bad_alloc & )
+  {
+    pp( "Not enough memory. Find a machine with more memory" );
+    retval = 1;
+  }
+  catch( Error e ) { pp(); show_error( e.msg, errno ); retval = 1; }
   return retval;
 }
 
@@ -296,7 +435,7 @@ int fcompress( const long long member_size, const long long volume_size,
   File_header header;
   header.set_magic();
   int retval = 0;
-
+  try {
     Fmatchfinder fmatchfinder( infd );
     header.dictionary_size( fmatchfinder.dictionary_size() );
 
@@ -327,89 +466,685 @@ int fcompress( const long long member_size, const long long volume_size,
       fmatchfinder.reset();
     }
 
-    if( retval == 0 && verbosity >= 1 )
-    {
-      if( in_size <= 0 || out_size <= 0 )
-        fprintf( stderr, "No data compressed.\n" );
+    if( retval == 0 ) show_stats( in_size, out_size );
+  }
+  catch( std::bad_alloc & )
+  {
+    pp( "Not enough memory. Find a machine with more memory" );
+    retval = 1;
+  }
+  catch( Error e ) { pp(); show_error( e.msg, errno ); retval = 1; }
+  return retval;
+}
+
+
+// A chunk of the input compressed as one member by a worker thread of
+// 'compress_parallel'.
+struct Chunk_task : public Task
+{
+  uint8_t * data;		// input, freed once compressed
+  int size;
+  const Lzma_options * const options;	// 0 selects the fast encoder
+  Mem_writer writer;		// the member
+  int result;			// 0 = OK, 1 = encoder error, -1 = no memory
+
+  Chunk_task( const int max_size, const Lzma_options * const o )
+    : data( (uint8_t *)malloc( max_size ) ), size( 0 ), options( o ),
+      result( 0 )
+  { if( !data ) throw std::bad_alloc(); }
+
+  ~Chunk_task() { free( data ); }
+
+  void run()
+  {
+    try {
+      Mem_reader reader( data, size );
+      File_header header;
+      header.set_magic();
+      if( options )
+      {
+        header.dictionary_size( options->dictionary_size );
+        Matchfinder matchfinder( header.dictionary_size(),
+                                 options->match_len_limit, -1, &reader );
+        header.dictionary_size( matchfinder.dictionary_size() );
+        LZ_encoder encoder( matchfinder, header, -1, &writer );
+        if( !encoder.encode_member( LLONG_MAX ) ) result = 1;
+      }
       else
-        fprintf( stderr, "%6.3f:1, %6.3f bits/byte, "
-                              "%5.2f%% saved, %lld in, %lld out.\n",
-                      (double)in_size / out_size,
-                      ( 8.0 * out_size ) / in_size,
-                      100.0 * ( 1.0 - ( (double)out_size / in_size ) ),
-                      in_size, out_size );
+      {
+        Fmatchfinder fmatchfinder( -1, &reader );
+        header.dictionary_size( fmatchfinder.dictionary_size() );
+        FLZ_encoder encoder( fmatchfinder, header, -1, &writer );
+        if( !encoder.encode_member( LLONG_MAX ) ) result = 1;
+      }
+    }
+    catch( std::bad_alloc & ) { result = -1; }
+    free( data ); data = 0;
+  }
+
+private:
+  Chunk_task( const Chunk_task & );		// declared as private
+  void operator=( const Chunk_task & );	// declared as private
+};
+
+
+// Compresses the input in chunks of at most 'member_size' bytes, each of
+// them as an independent member, on 'num_workers' threads. The members
+// are written in order, with at most 2 * 'num_workers' chunks in flight.
+// 'encoder_options' is 0 for the fast encoder.
+int compress_parallel( const long long member_size,
+                       const Lzma_options * const encoder_options,
+                       const int infd, const int num_workers )
+{
+  File_header header;
+  header.set_magic();
+  if( encoder_options &&
+      ( !header.dictionary_size( encoder_options->dictionary_size ) ||
+        encoder_options->match_len_limit < min_match_len_limit ||
+        encoder_options->match_len_limit > max_match_len ) )
+    internal_error( "invalid argument to encoder" );
+  // Large enough for the dictionary to be filled twice.
+  const int chunk_size = min( member_size, (long long)max( 1 << 20,
+    encoder_options ? 2 * header.dictionary_size() : 1 << 20 ) );
+  int retval = 0;
+  try {
+    Worker_pool pool( num_workers );
+    const unsigned max_pending = 2 * num_workers;
+    long long in_size = 0, out_size = 0;
+    bool at_eof = false, first_chunk = true;
+    while( true )
+    {
+      if( !at_eof && pool.size() < max_pending )
+      {
+        Chunk_task * const task = new Chunk_task( chunk_size, encoder_options );
+        task->size = readblock( infd, task->data, chunk_size );
+        if( task->size < chunk_size )
+        {
+          if( errno ) { delete task; throw Error( "Read error" ); }
+          at_eof = true;
+        }
+        if( task->size > 0 || first_chunk )	// an empty input gives
+          { pool.put( task ); first_chunk = false; }	// an empty member
+        else delete task;
+        continue;
+      }
+      if( pool.size() == 0 ) break;
+      const Chunk_task & task =
+        static_cast< const Chunk_task & >( pool.first() );
+      if( task.result < 0 ) throw std::bad_alloc();
+      if( task.result > 0 ) { pp( "Encoder error" ); retval = 1; break; }
+      for( long long i = 0; i < task.writer.size(); )
+      {
+        const int n = min( (long long)INT_MAX, task.writer.size() - i );
+        if( writeblock( outfd, task.writer.data() + i, n ) != n )
+          throw Error( "Write error" );
+        i += n;
+      }
+      in_size += task.size; out_size += task.writer.size();
+      pool.delete_first();
     }
+    if( retval == 0 ) show_stats( in_size, out_size );
+  }
+  catch( std::bad_alloc & )
+  {
+    pp( "Not enough memory. Find a machine with more memory" );
+    retval = 1;
+  }
+  catch( Error e ) { pp(); show_error( e.msg, errno ); retval = 1; }
   return retval;
 }
 #endif
 
-int decompress( const int infd, const bool testing )
+// Maps a regular input file into memory so that the decoder can read it
+// in place. Returns false (and the fd is used instead) if not possible.
+//
+class Input_map
 {
-  int retval = 0;
+  void * map;
+  long long size;
+
+public:
+  explicit Input_map( const int infd ) : map( 0 ), size( 0 )
+  {
+#if !defined(__MSVCRT__) && !defined(__OS2__)
+    struct stat st;
+    if( fstat( infd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+        st.st_size <= 0 || (unsigned long long)st.st_size > (size_t)-1 )
+      return;
+    void * const p = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, infd, 0 );
+    if( p == MAP_FAILED ) return;
+    madvise( p, st.st_size, MADV_SEQUENTIAL );
+    map = p; size = st.st_size;
+#endif
+  }
+
+  ~Input_map()
+  {
+#if !defined(__MSVCRT__) && !defined(__OS2__)
+    if( map ) munmap( map, size );
+#endif
+  }
+
+  bool mapped() const { return map != 0; }
+  const uint8_t * data() const { return (const uint8_t *)map; }
+  long long data_size() const { return size; }
+};
+
 
-    Range_decoder rdec( infd );
-    long long partial_file_pos = 0;
-    for( bool first_member = true; ; first_member = false )
+// Maps 'size' bytes of a regular output file opened for reading and
+// writing, starting at its current end, so that the decoder can use the
+// file itself as its window. Nothing is mapped if the output is not
+// such a file.
+class Output_map
+{
+  const int fd;
+  void * map;
+  long long map_size;
+  long long offset;		// original end of file
+  long long delta;		// offset of the data within the map
+
+public:
+  Output_map( const int outfd, const long long size )
+    : fd( outfd ), map( 0 ), map_size( 0 ), offset( 0 ), delta( 0 )
+  {
+#if !defined(__MSVCRT__) && !defined(__OS2__)
+    struct stat st;
+    if( fd < 0 || fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+        ( fcntl( fd, F_GETFL ) & O_ACCMODE ) != O_RDWR ) return;
+    const long long pos = lseek( fd, 0, SEEK_CUR );
+    if( pos < 0 || pos != st.st_size ) return;
+    const long long page_size = sysconf( _SC_PAGESIZE );
+    if( page_size <= 0 ) return;
+    delta = pos % page_size;
+    map_size = delta + size;
+    if( size <= 0 || (unsigned long long)map_size > (size_t)-1 ||
+        ftruncate( fd, pos + size ) != 0 ) return;
+    void * const p = mmap( 0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           fd, pos - delta );
+    if( p == MAP_FAILED ) { ftruncate( fd, pos ); return; }
+    map = p; offset = pos;
+#endif
+  }
+
+  ~Output_map() { finish( 0 ); }
+
+  bool mapped() const { return map != 0; }
+  uint8_t * data() const { return (uint8_t *)map + delta; }
+
+  // Unmaps the file, leaving 'size' bytes of data after its original end.
+  void finish( const long long size )
+  {
+#if !defined(__MSVCRT__) && !defined(__OS2__)
+    if( !map ) return;
+    munmap( map, map_size ); map = 0;
+    if( ftruncate( fd, offset + size ) != 0 ||
+        lseek( fd, offset + size, SEEK_SET ) < 0 )
+      throw Error( "Write error" );
+#endif
+  }
+};
+
+
+void show_member_header( const File_header & header, const bool first_member )
+{
+  if( verbosity >= 2 || ( verbosity == 1 && first_member ) )
+  {
+    pp();
+    if( verbosity >= 2 )
+      fprintf( stderr, "version %d, dictionary size %7sB.  ",
+                    header.version(),
+                    format_num( header.dictionary_size() ) );
+  }
+}
+
+
+void show_decoder_error( const int result, const long long pos )
+{
+  if( verbosity >= 0 && result <= 2 )
+  {
+    pp();
+    if( result == 2 )
+      fprintf( stderr, "File ends unexpectedly at pos %lld\n", pos );
+    else
+      fprintf( stderr, "Decoder error at pos %lld\n", pos );
+  }
+}
+
+
+void show_member_done( const int window_size, const bool testing )
+{
+  if( verbosity >= 2 )
+  {
+    fprintf( stderr, "window size %7sB.  ", format_num( window_size ) );
+    if( testing ) fprintf( stderr, "ok\n" );
+    else fprintf( stderr, "done\n" );
+  }
+}
+
+
+// Decodes the indexed 'members' of 'inbuf' into the mapped output with
+// 'decode_members', and reports them as 'decode_stream' does.
+int decompress_members( const uint8_t * const inbuf,
+                        const std::vector< Member_info > & members,
+                        Output_map & output_map )
+{
+  unsigned failed = members.size();
+  long long error_pos = 0;
+  const int result = decode_members( inbuf, members, output_map.data(),
+                                     false, failed, error_pos );
+  long long data_pos = 0;
+  for( unsigned i = 0; i < members.size() && i <= failed; ++i )
+  {
+    File_header header;
+    memcpy( header.data, inbuf + members[i].pos, File_header::size );
+    show_member_header( header, i == 0 );
+    if( i == failed ) { show_decoder_error( result, error_pos ); break; }
+    data_pos += members[i].data_size;
+    show_member_done( 0, false );
+  }
+  output_map.finish( data_pos );
+  return ( result != 0 ) ? 2 : 0;
+}
+
+
+// Decodes the members read by 'rdec' one after another into 'outfd'.
+// 'partial_file_pos' is the position of the first of them in the input,
+// and 'first_member' tells if it is the first member of the input. The
+// decoder is created, or reused with its window.
+int decode_stream( Range_decoder & rdec, LZ_decoder *& decoder,
+                   const bool testing, long long partial_file_pos,
+                   bool first_member )
+{
+  for( ; ; first_member = false )
+  {
+    File_header header;
+    int size;
+    rdec.reset_member_position();
+    for( size = 0; size < File_header::size && !rdec.finished(); ++size )
+       header.data[size] = rdec.get_byte();
+    if( rdec.finished() )			// End Of File
     {
-      File_header header;
-      int size;
-      rdec.reset_member_position();
-      for( size = 0; size < File_header::size && !rdec.finished(); ++size )
-         header.data[size] = rdec.get_byte();
-      if( rdec.finished() )			// End Of File
+      if( first_member )
+      { pp( "Error reading member header" ); return 1; }
+      break;
+    }
+    if( !header.verify_magic() )
+    {
+      if( first_member )
+      { pp( "Bad magic number (file not in lzip format)" ); return 2; }
+      break;
+    }
+    if( !header.verify_version() )
+    {
+      if( verbosity >= 0 )
+      { pp();
+          fprintf( stderr, "Version %d member format not supported.\n",
+                        header.version() ); }
+      return 2;
+    }
+    if( header.dictionary_size() < min_dictionary_size ||
+        header.dictionary_size() > max_dictionary_size )
+    { pp( "Invalid dictionary size in member header" ); return 2; }
+
+    show_member_header( header, first_member );
+    if( decoder ) decoder->reset( header );
+    else
+    {
+      decoder = new LZ_decoder( header, rdec, outfd );
+      if( sysconf( _SC_NPROCESSORS_ONLN ) > 1 )	// else it only adds
+        decoder->start_write_behind();		// context switches
+    }
+    const int result = decoder->decode_member();
+    partial_file_pos += rdec.member_position();
+    if( result != 0 )
+    { show_decoder_error( result, partial_file_pos ); return 2; }
+    show_member_done( decoder->window_size(), testing );
+  }
+  return 0;
+}
+
+
+// Some members decoded by a worker thread of 'decompress_parallel'.
+struct Member_task : public Task
+{
+  const uint8_t * const data;	// input of the members
+  uint8_t * const copy;		// data read from a pipe, owned
+  const long long pos;		// position of 'data' in the input
+  std::vector< Member_info > members;	// relative to 'data'
+  uint8_t * const outbuf;	// into the mapped output, or 0
+  Mem_writer writer;		// output if not mapped
+  unsigned failed;		// first member that failed
+  long long error_pos;		// relative to 'data'
+  int result;			// of 'decode_members', or -1 if no memory
+
+  Member_task( const uint8_t * const d, uint8_t * const c, const long long p,
+               const std::vector< Member_info > & m, uint8_t * const o )
+    : data( d ), copy( c ), pos( p ), members( m ), outbuf( o ),
+      failed( m.size() ), error_pos( 0 ), result( 0 ) {}
+
+  ~Member_task() { free( copy ); }
+
+  void run()
+  {
+    try {
+      uint8_t * out = outbuf;
+      long long data_size = 0;
+      for( unsigned i = 0; i < members.size(); ++i )
+        data_size += members[i].data_size;
+      if( !out && data_size > 0 ) out = writer.reserve( data_size );
+      result = decode_members( data, members, out, false, failed, error_pos );
+      if( !outbuf )			// the members before 'failed' are valid
       {
-        if( first_member )
-        { pp( "Error reading member header" ); retval = 1; }
-        break;
+        long long valid_size = 0;
+        for( unsigned i = 0; i < failed && i < members.size(); ++i )
+          valid_size += members[i].data_size;
+        writer.commit( valid_size );
       }
-      if( !header.verify_magic() )
+    }
+    catch( std::bad_alloc & ) { result = -1; }
+  }
+
+private:
+  Member_task( const Member_task & );		// declared as private
+  void operator=( const Member_task & );	// declared as private
+};
+
+
+// Finds the end of the first members of the 'size' bytes at 'buf', where
+// the header of another member follows a trailer whose member size is
+// consistent with it, and lists those members in 'members'. Returns 0 if
+// not found. The search goes on from 'scan_pos' when more data is added.
+long long find_members_end( const uint8_t * const buf, const long long size,
+                            long long & scan_pos,
+                            std::vector< Member_info > & members )
+{
+  const long long min_member_size =
+    File_header::size + File_trailer::size() + 5;
+  if( scan_pos < min_member_size ) scan_pos = min_member_size;
+  while( scan_pos + File_header::size <= size )
+  {
+    const uint8_t * const p = (const uint8_t *)
+      memchr( buf + scan_pos, magic_string[0],
+              size - File_header::size + 1 - scan_pos );
+    if( !p ) { scan_pos = size - File_header::size + 1; break; }
+    scan_pos = p - buf + 1;
+    File_header header;
+    memcpy( header.data, p, File_header::size );
+    if( header.verify_magic() && index_members( buf, p - buf, members ) )
+      return p - buf;
+  }
+  return 0;
+}
+
+
+// Splits the input into tasks for 'decompress_parallel'. The members of a
+// regular file are indexed from their trailers. Else the input is read
+// ahead, up to 'max_read_ahead' bytes, and split with 'find_members_end'
+// into tasks of about 'block_size' bytes, so that small members don't
+// make a task each. What can't be split this way (for example a last
+// member followed by trailing garbage, or a member too large to be read
+// ahead) is left in 'rest' to be decoded with 'decode_stream'.
+class Member_source
+{
+  enum { block_size = 1 << 20, max_read_ahead = 32 * block_size,
+         max_task_data = 8 * block_size };
+  const int infd;
+  const std::vector< Member_info > & index;	// members of a mapped input
+  unsigned next;		// next member in 'index'
+  uint8_t * outbuf;		// mapped output of the next member, or 0
+  uint8_t * owned;		// data read ahead from a pipe
+  const uint8_t * buffer;	// data to split, in 'owned' or in the map
+  long long size;		// data in buffer
+  long long capacity;		// of 'owned'
+  long long buffer_pos;		// position of buffer[0] in the input
+  long long scan_pos;		// relative to buffer + task_end
+  std::vector< Member_info > task_members;	// found for the next task
+  long long task_end;		// end of 'task_members' in buffer
+  long long task_data_size;	// of 'task_members'
+  bool at_eof;
+
+  Member_source( const Member_source & );	// declared as private
+  void operator=( const Member_source & );	// declared as private
+
+  void add_members( const std::vector< Member_info > & members,
+                    const long long end )
+  {
+    for( unsigned i = 0; i < members.size(); ++i )
+    {
+      task_members.push_back( members[i] );
+      task_members.back().pos += task_end;
+      task_data_size += members[i].data_size;
+    }
+    task_end += end; scan_pos = 0;
+  }
+
+       // Only the data after the task is copied, if read from a pipe.
+  Member_task * take_task()
+  {
+    Member_task * task;
+    if( owned )				// the task takes the data read
+    {
+      const long long new_capacity =
+        max( (long long)block_size, size - task_end );
+      uint8_t * const tmp = (uint8_t *)malloc( new_capacity );
+      if( !tmp ) throw std::bad_alloc();
+      memcpy( tmp, owned + task_end, size - task_end );
+      task = new Member_task( owned, owned, buffer_pos, task_members, 0 );
+      buffer = owned = tmp; capacity = new_capacity;
+    }
+    else
+    {
+      task = new Member_task( buffer, 0, buffer_pos, task_members, 0 );
+      buffer += task_end;
+    }
+    size -= task_end; buffer_pos += task_end;
+    task_members.clear(); task_end = 0; task_data_size = 0;
+    return task;
+  }
+
+public:
+  const uint8_t * rest;
+  long long rest_size;
+  long long rest_pos;		// position of 'rest' in the input
+  bool rest_in_fd;		// the input after 'rest' is still to be read
+
+       // 'map' is the input if mapped, with its members in 'members' if
+       // indexed, and their output in 'outmap' if mapped.
+  Member_source( const int ifd, const uint8_t * const map,
+                 const long long map_size,
+                 const std::vector< Member_info > & members,
+                 uint8_t * const outmap )
+    : infd( ifd ), index( members ), next( 0 ), outbuf( outmap ),
+      owned( 0 ), buffer( map ), size( map ? map_size : 0 ), capacity( 0 ),
+      buffer_pos( 0 ), scan_pos( 0 ), task_end( 0 ), task_data_size( 0 ),
+      at_eof( map != 0 ),
+      rest( 0 ), rest_size( 0 ), rest_pos( 0 ), rest_in_fd( false ) {}
+
+  ~Member_source() { free( owned ); }
+
+       // Returns the next task, or 0 at the end of the members.
+  Member_task * next_task()
+  {
+    std::vector< Member_info > members;
+    if( !index.empty() )
+    {
+      if( next >= index.size() ) return 0;
+      const Member_info & member = index[next++];
+      members.push_back( member ); members[0].pos = 0;
+      Member_task * const task =
+        new Member_task( buffer + member.pos, 0, member.pos, members, outbuf );
+      if( outbuf ) outbuf += member.data_size;
+      return task;
+    }
+    while( true )
+    {
+      long long end;
+      while( task_end < block_size && task_data_size < max_task_data &&
+             ( end = find_members_end( buffer + task_end, size - task_end,
+                                       scan_pos, members ) ) > 0 )
+        add_members( members, end );
+      if( task_end == 0 && at_eof )
       {
-        if( first_member )
-        { pp( "Bad magic number (file not in lzip format)" ); retval = 2; }
-        break;
+        if( size == 0 && buffer_pos > 0 ) return 0;
+        if( !index_members( buffer, size, members ) )
+        {
+          rest = buffer; rest_size = size; rest_pos = buffer_pos;
+          return 0;
+        }
+        add_members( members, size );
       }
-      if( !header.verify_version() )
+      if( task_end > 0 &&		// full, or a large member follows
+          ( task_end >= block_size || task_data_size >= max_task_data ||
+            size - task_end >= block_size || at_eof ) )
+        return take_task();
+      if( size >= max_read_ahead )	// decode the rest sequentially
       {
-        if( verbosity >= 0 )
-        { pp();
-            fprintf( stderr, "Version %d member format not supported.\n",
-                          header.version() ); }
-        retval = 2; break;
+        rest = buffer; rest_size = size; rest_pos = buffer_pos;
+        rest_in_fd = true;
+        return 0;
       }
-      if( header.dictionary_size() < min_dictionary_size ||
-          header.dictionary_size() > max_dictionary_size )
-      { pp( "Invalid dictionary size in member header" ); retval = 2; break; }
-
-      if( verbosity >= 2 || ( verbosity == 1 && first_member ) )
+      if( capacity - size < block_size )
       {
-        pp();
-        if( verbosity >= 2 )
-          fprintf( stderr, "version %d, dictionary size %7sB.  ",
-                        header.version(),
-                        format_num( header.dictionary_size() ) );
+        const long long new_capacity = max( 2 * capacity, size + block_size );
+        uint8_t * const tmp = (uint8_t *)realloc( owned, new_capacity );
+        if( !tmp ) throw std::bad_alloc();
+        buffer = owned = tmp; capacity = new_capacity;
       }
-      LZ_decoder decoder( header, rdec, outfd );
+      const int n = readblock( infd, owned + size, block_size );
+      if( n < block_size && errno ) throw Error( "Read error" );
+      size += n;
+      if( n < block_size ) at_eof = true;
+    }
+  }
+};
 
-      const int result = decoder.decode_member();
-      partial_file_pos += rdec.member_position();
-      if( result != 0 )
+
+// Reports the members of a decoded 'task' and writes their data, unless
+// it is in the mapped output, where 'data_pos' is advanced instead. The
+// data of the members before a failed one is written too, as
+// 'decode_stream' does.
+int write_task( const Member_task & task, bool & first_member,
+                const bool testing, long long & data_pos )
+{
+  if( task.result < 0 ) throw std::bad_alloc();
+  int retval = 0;
+  for( unsigned i = 0; i < task.members.size(); ++i, first_member = false )
+  {
+    File_header header;
+    memcpy( header.data, task.data + task.members[i].pos, File_header::size );
+    show_member_header( header, first_member );
+    if( i == task.failed )
+    { show_decoder_error( task.result, task.pos + task.error_pos );
+      retval = 2; break; }
+    data_pos += task.members[i].data_size;
+    show_member_done( 0, testing );
+  }
+  if( !testing && !task.outbuf )
+    for( long long i = 0; i < task.writer.size(); )
+    {
+      const int n = min( (long long)INT_MAX, task.writer.size() - i );
+      if( writeblock( outfd, task.writer.data() + i, n ) != n )
+        throw Error( "Write error" );
+      i += n;
+    }
+  return retval;
+}
+
+
+// Decodes the members on 'num_workers' threads. Data decoded ahead of
+// the output is limited to that of 2 * 'num_workers' tasks.
+int decompress_parallel( const int infd, const bool testing,
+                         const int num_workers )
+{
+  int retval = 0;
+  LZ_decoder * decoder = 0;
+  try {
+    Input_map input_map( infd );
+    std::vector< Member_info > members;
+    long long total_size = 0;
+    if( input_map.mapped() &&
+        index_members( input_map.data(), input_map.data_size(), members ) )
+      for( unsigned i = 0; i < members.size(); ++i )
+        total_size += members[i].data_size;
+    Output_map output_map( ( total_size && !testing ) ? outfd : -1,
+                           total_size );
+    Member_source source( infd, input_map.data(), input_map.data_size(),
+                          members,
+                          output_map.mapped() ? output_map.data() : 0 );
+    long long data_pos = 0;		// data written to the mapped output
+    bool first_member = true;
+    {
+      Worker_pool pool( num_workers );	// stopped before unmapping
+      const unsigned max_pending = 2 * num_workers;
+      bool source_done = false;
+      while( retval == 0 )
       {
-        if( verbosity >= 0 && result <= 2 )
+        if( !source_done && pool.size() < max_pending )
         {
-          pp();
-          if( result == 2 )
-            fprintf( stderr, "File ends unexpectedly at pos %lld\n",
-                          partial_file_pos );
-          else
-            fprintf( stderr, "Decoder error at pos %lld\n",
-                          partial_file_pos );
+          Member_task * const task = source.next_task();
+          if( task ) { pool.put( task ); continue; }
+          source_done = true;
         }
-        retval = 2; break;
+        if( pool.size() == 0 ) break;
+        retval = write_task( static_cast< const Member_task & >( pool.first() ),
+                             first_member, testing, data_pos );
+        pool.delete_first();
       }
-      if( verbosity >= 2 )
-      { if( testing ) fprintf( stderr, "ok\n" );
-          else fprintf( stderr, "done\n" ); }
     }
+    if( retval == 0 && source.rest )
+    {
+      Mem_reader mem_reader( source.rest, source.rest_size );
+      Range_decoder rdec( source.rest_in_fd ? infd : -1, &mem_reader );
+      retval = decode_stream( rdec, decoder, testing, source.rest_pos,
+                              first_member );
+    }
+    output_map.finish( data_pos );
+  }
+  catch( std::bad_alloc & )
+  {
+    pp( "Not enough memory. Find a machine with more memory" );
+    retval = 1;
+  }
+  catch( Error e ) { pp(); show_error( e.msg, errno ); retval = 1; }
+  delete decoder;
+  if( verbosity == 1 && retval == 0 )
+  { if( testing ) fprintf( stderr, "ok\n" );
+      else fprintf( stderr, "done\n" ); }
+  return retval;
+}
+
+
+int decompress( const int infd, const bool testing, const int num_workers )
+{
+  if( num_workers > 1 )
+    return decompress_parallel( infd, testing, num_workers );
+  int retval = 0;
+  LZ_decoder * decoder = 0;	// reused, with its window, for all members
+  try {
+    Input_map input_map( infd );
+    Mem_reader mem_reader( input_map.data(), input_map.data_size() );
+    Range_decoder rdec( input_map.mapped() ? -1 : infd,
+                        input_map.mapped() ? &mem_reader : 0 );
+    // If the sizes of all members are known, and the output can be
+    // mapped, decode straight into the output file (linear mode).
+    std::vector< Member_info > members;
+    long long total_size = 0;
+    if( input_map.mapped() && !testing &&
+        index_members( input_map.data(), input_map.data_size(), members ) )
+      for( unsigned i = 0; i < members.size(); ++i )
+        total_size += members[i].data_size;
+    Output_map output_map( total_size ? outfd : -1, total_size );
+    if( output_map.mapped() )
+      retval = decompress_members( input_map.data(), members, output_map );
+    else retval = decode_stream( rdec, decoder, testing, 0, true );
+  }
+  catch( std::bad_alloc & )
+  {
+    pp( "Not enough memory. Find a machine with more memory" );
+    retval = 1;
+  }
+  catch( Error e ) { pp(); show_error( e.msg, errno ); retval = 1; }
+  delete decoder;
   if( verbosity == 1 && retval == 0 )
   { if( testing ) fprintf( stderr, "ok\n" );
       else fprintf( stderr, "done\n" ); }
@@ -470,6 +1205,7 @@ int main( const int argc, const char * const argv[] )
   bool keep_input_files = false;
   bool to_stdout = false;
   bool zero = false;
+  int num_workers = 1;
   invocation_name = argv[0];
 
   // Greatly simplified argument parsing
@@ -483,6 +1219,18 @@ int main( const int argc, const char * const argv[] )
       case 'd': program_mode = m_decompress; break;
       case 'h': show_help(); return 0;
       case 'k': keep_input_files = true; break;
+      case 'n':
+      {
+        const char * const arg =
+          argv[argind][2] ? argv[argind] + 2 :
+          ( argind + 1 < argc ) ? argv[++argind] : "";
+        char * tail;
+        const long n = strtol( arg, &tail, 0 );
+        if( tail == arg || *tail || n < 1 || n > max_workers )
+        { show_error( "Invalid number of threads", 0, true ); return 1; }
+        num_workers = n;
+        break;
+      }
       case 'q': verbosity = -1; break;
                 zero = false; break;
       case 'v': if( verbosity < 4 ) ++verbosity; break;
@@ -498,13 +1246,6 @@ int main( const int argc, const char * const argv[] )
 
   if( program_mode == m_test )
     outfd = -1;
-#if !DECODER_ONLY
-  else if( program_mode == m_compress )
-  {
-    dis_slots.init();
-    prob_prices.init();
-  }
-#endif
 
   int retval = 0;
   {
@@ -521,7 +1262,10 @@ int main( const int argc, const char * const argv[] )
 #if !DECODER_ONLY
     if( program_mode == m_compress )
     {
-      if( zero )
+      if( num_workers > 1 && volume_size == LLONG_MAX )	// no volumes
+        tmp = compress_parallel( member_size, zero ? 0 : &encoder_options,
+                                 infd, num_workers );
+      else if( zero )
         tmp = fcompress( member_size, volume_size, infd, in_statsp );
       else
         tmp = compress( member_size, volume_size, encoder_options, infd,
@@ -529,7 +1273,7 @@ int main( const int argc, const char * const argv[] )
     }
     else
 #endif
-      tmp = decompress( infd, program_mode == m_test );
+      tmp = decompress( infd, program_mode == m_test, num_workers );
     if( tmp > retval ) retval = tmp;
     //if( tmp && program_mode != m_test ) cleanup_and_fail( retval );
 
@@ -0,0 +1,414 @@
+/*  Lzbench - Benchmarks of the lzip library (lzlib.h)
+    Copyright (C) 2008, 2009, 2010, 2011 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    Usage: lzbench [-r runs] [-o output] mode [files]
+
+    decode  Compresses each input (8 MiB dictionary, match length limit
+            36) and reports the time taken by LZ_decompress_buffer to
+            decompress it, in cycles per compressed bit.
+
+    write   Compresses each input with a 64 KiB and an 8 MiB dictionary,
+            and reports the time taken by the decoder of lzip to
+            decompress it from a file to 'output' (default /dev/null),
+            without and with the write-behind thread, in millions of
+            cycles.
+
+    far     Generates 32 MiB of random data followed by 32 MiB of 16 to
+            32 byte pieces copied from random positions in it, so that
+            nearly every match is far away, compresses it with a 64 MiB
+            dictionary, and reports the time taken by LZ_decompress_buffer
+            to decompress the pieces, in millions of cycles. That is the
+            time for the whole data minus the time for the random part.
+            Takes no files.
+
+    match   Generates a 24 MiB disk image of 4 KiB blocks, a quarter of
+            them zero and the rest copied from a small pool, half of
+            those with one byte changed, so that most matches are long.
+            Reports the time taken by LZ_compress_buffer to compress it
+            with an 8 MiB dictionary and match length limits of 273 and
+            36, and with the fast encoder, in millions of cycles. Takes
+            no files.
+
+    The inputs are generated from a fixed seed, and followed by the
+    'files' given. Each time is the best of 'runs' runs (default 10, or
+    3 for 'match'). Times are in TSC cycles on x86, else in nanoseconds.
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "lzlib.h"
+#include "lzip.h"
+#include "decoder.h"
+
+
+namespace {
+
+struct Input
+  {
+  std::string name;
+  std::string data;
+  };
+
+int runs = 0;			// 0 means the default of the mode
+const char * output_name = "/dev/null";
+
+
+#if defined(__x86_64__) || defined(__i386__)
+const char * const time_unit = "cycles";
+unsigned long long now() { return __builtin_ia32_rdtsc(); }
+#else
+const char * const time_unit = "ns";
+unsigned long long now()
+  {
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+#endif
+
+
+unsigned next_random( unsigned & seed )
+  { seed = seed * 1103515245U + 12345U; return seed >> 8; }
+
+     // the low bits of 'next_random' repeat too soon for random data
+char random_byte( unsigned & seed ) { return next_random( seed ) >> 8; }
+
+
+     // Inputs with different proportions of literals and matches.
+void make_inputs( std::vector< Input > & inputs )
+  {
+  static const char * const words[] =
+    { "the ", "lzip ", "member ", "window ", "of ", "data ", "range ",
+      "decoder\n", "and ", "match ", "literal ", "a " };
+  const int size = 4 << 20;
+  unsigned seed = 1;
+  Input in;
+  in.name = "text";
+  while( (int)in.data.size() < size )
+    in.data += words[next_random( seed ) % 12];
+  inputs.push_back( in );
+  in.name = "mixed"; in.data.clear();	// runs, repeats and noise
+  while( (int)in.data.size() < size )
+    {
+    const int len = next_random( seed ) % 200;
+    const unsigned kind = next_random( seed ) % 3;
+    std::string & s = in.data;
+    if( kind == 0 ) s.append( len, random_byte( seed ) );
+    else if( kind == 1 && s.size() > 65536 )
+      s.append( s, s.size() - 1 - next_random( seed ) % 65536, len );
+    else for( int j = 0; j < len; ++j ) s += random_byte( seed );
+    }
+  inputs.push_back( in );
+  in.name = "random"; in.data.clear();
+  while( (int)in.data.size() < size / 2 ) in.data += random_byte( seed );
+  inputs.push_back( in );
+  in.name = "periodic"; in.data.clear();	// short periods, short runs
+  while( (int)in.data.size() < size )
+    {
+    const int period = 1 + next_random( seed ) % 15;
+    const int len = 20 + next_random( seed ) % 80;
+    std::string pattern;
+    for( int j = 0; j < period; ++j ) pattern += random_byte( seed );
+    for( int j = 0; j < len; ++j ) in.data += pattern[j%period];
+    }
+  inputs.push_back( in );
+  }
+
+
+bool read_file( const char * const name, std::string & data )
+  {
+  FILE * const f = fopen( name, "rb" );
+  if( !f ) return false;
+  char buf[65536];
+  size_t n;
+  while( ( n = fread( buf, 1, sizeof buf, f ) ) > 0 ) data.append( buf, n );
+  const bool ok = !ferror( f );
+  fclose( f );
+  return ok;
+  }
+
+
+bool compress( const std::string & in, std::string & out,
+               const int dictionary_size = 1 << 23,
+               const int match_len_limit = 36 )
+  {
+  LZ_Encoder * const encoder =
+    LZ_compress_open( dictionary_size, match_len_limit, 1LL << 50 );
+  const uint8_t * p;
+  const long long size = encoder ?
+    LZ_compress_buffer( encoder, (const uint8_t *)in.data(), in.size(), &p ) : -1;
+  if( size >= 0 ) out.assign( (const char *)p, size );
+  LZ_compress_close( encoder );
+  return size >= 0;
+  }
+
+
+     // Returns the best time of 'runs' decompressions of 'packed', or 0
+     // if it can't be decompressed.
+unsigned long long time_decompress( LZ_Decoder * const decoder,
+                                    const std::string & packed )
+  {
+  unsigned long long best = 0;
+  for( int i = 0; i < runs; ++i )
+    {
+    const uint8_t * p;
+    const unsigned long long t0 = now();
+    if( LZ_decompress_buffer( decoder, (const uint8_t *)packed.data(),
+                              packed.size(), &p ) < 0 ) return 0;
+    const unsigned long long t = now() - t0;
+    if( i == 0 || t < best ) best = t;
+    }
+  return best;
+  }
+
+
+int bench_decode( const std::vector< Input > & inputs )
+  {
+  LZ_Decoder * const decoder = LZ_decompress_open();
+  if( !decoder ) return 1;
+  printf( "%-12s %10s %10s %8s  %s/bit\n",
+          "input", "size", "packed", "ratio", time_unit );
+  for( unsigned i = 0; i < inputs.size(); ++i )
+    {
+    const Input & in = inputs[i];
+    std::string packed;
+    if( !compress( in.data, packed ) )
+      { fprintf( stderr, "lzbench: can't compress '%s'.\n", in.name.c_str() );
+        return 1; }
+    const unsigned long long t = time_decompress( decoder, packed );
+    if( t == 0 )
+      { fprintf( stderr, "lzbench: can't decompress '%s'.\n", in.name.c_str() );
+        return 1; }
+    printf( "%-12s %10lu %10lu %7.1f:1  %6.1f\n", in.name.c_str(),
+            (unsigned long)in.data.size(), (unsigned long)packed.size(),
+            (double)in.data.size() / packed.size(),
+            (double)t / ( 8.0 * packed.size() ) );
+    }
+  LZ_decompress_close( decoder );
+  return 0;
+  }
+
+
+bool read_header( Range_decoder & rdec, File_header & header )
+  {
+  for( int i = 0; i < File_header::size; ++i )
+    {
+    if( rdec.finished() ) return false;
+    header.data[i] = rdec.get_byte();
+    }
+  return header.verify_magic();
+  }
+
+
+     // Decodes the members in 'infd' to 'outfd' as lzip does. Returns the
+     // best time of 'runs' runs, or 0 if the data can't be decoded.
+unsigned long long time_decode_file( const int infd, const int outfd,
+                                     const bool write_behind )
+  {
+  unsigned long long best = 0;
+  for( int i = 0; i < runs; ++i )
+    {
+    if( lseek( infd, 0, SEEK_SET ) != 0 ) return 0;
+    if( ftruncate( outfd, 0 ) == 0 ) lseek( outfd, 0, SEEK_SET );
+    const unsigned long long t0 = now();
+    Range_decoder rdec( infd );
+    LZ_decoder * decoder = 0;
+    File_header header;
+    bool ok = read_header( rdec, header );
+    while( ok )
+      {
+      if( decoder ) decoder->reset( header );
+      else
+        {
+        decoder = new LZ_decoder( header, rdec, outfd );
+        if( write_behind && !decoder->start_write_behind() ) ok = false;
+        }
+      if( !ok || decoder->decode_member() != 0 ) { ok = false; break; }
+      rdec.reset_member_position();
+      if( rdec.finished() ) break;
+      ok = read_header( rdec, header );
+      }
+    delete decoder;
+    if( !ok ) return 0;
+    const unsigned long long t = now() - t0;
+    if( i == 0 || t < best ) best = t;
+    }
+  return best;
+  }
+
+
+int bench_write( const std::vector< Input > & inputs )
+  {
+  const int outfd = open( output_name, O_CREAT | O_WRONLY, 0644 );
+  if( outfd < 0 )
+    { fprintf( stderr, "lzbench: can't open '%s'.\n", output_name );
+      return 1; }
+  printf( "%-12s %10s %10s %10s %12s %8s\n", "input", "size", "dictionary",
+          "direct", "write-behind", "change" );
+  for( unsigned i = 0; i < inputs.size(); ++i )
+    for( int dictionary_size = 1 << 16; dictionary_size <= 1 << 23;
+         dictionary_size <<= 7 )
+      {
+      const Input & in = inputs[i];
+      std::string packed;
+      FILE * const f = tmpfile();
+      if( !compress( in.data, packed, dictionary_size ) || !f ||
+          fwrite( packed.data(), 1, packed.size(), f ) != packed.size() ||
+          fflush( f ) != 0 )
+        { fprintf( stderr, "lzbench: can't compress '%s'.\n",
+                   in.name.c_str() ); return 1; }
+      const unsigned long long t1 = time_decode_file( fileno( f ), outfd, false );
+      const unsigned long long t2 = time_decode_file( fileno( f ), outfd, true );
+      fclose( f );
+      if( t1 == 0 || t2 == 0 )
+        { fprintf( stderr, "lzbench: can't decompress '%s'.\n",
+                   in.name.c_str() ); return 1; }
+      printf( "%-12s %10lu %9dK %10.1f %12.1f %+7.1f%%\n", in.name.c_str(),
+              (unsigned long)in.data.size(), dictionary_size >> 10,
+              t1 / 1e6, t2 / 1e6, 100.0 * ( (double)t2 - t1 ) / t1 );
+      }
+  close( outfd );
+  return 0;
+  }
+
+
+int bench_far()
+  {
+  const int size = 32 << 20;
+  unsigned seed = 1;
+  std::string base;
+  while( (int)base.size() < size ) base += random_byte( seed );
+  std::string data( base );
+  while( (int)data.size() < 2 * size )
+    {
+    const int len = 16 + next_random( seed ) % 17;
+    const unsigned r = ( next_random( seed ) << 8 ) ^ next_random( seed );
+    data.append( base, r % ( size - len ), len );
+    }
+  std::string packed_base, packed;
+  if( !compress( base, packed_base, 2 * size ) ||
+      !compress( data, packed, 2 * size ) )
+    { fputs( "lzbench: can't compress the data.\n", stderr ); return 1; }
+  LZ_Decoder * const decoder = LZ_decompress_open();
+  if( !decoder ) return 1;
+  const unsigned long long t1 = time_decompress( decoder, packed_base );
+  const unsigned long long t2 = time_decompress( decoder, packed );
+  LZ_decompress_close( decoder );
+  if( t1 == 0 || t2 == 0 )
+    { fputs( "lzbench: can't decompress the data.\n", stderr ); return 1; }
+  printf( "random part %10.1f M%s\n", t1 / 1e6, time_unit );
+  printf( "whole data  %10.1f M%s\n", t2 / 1e6, time_unit );
+  printf( "far matches %10.1f M%s\n", ( (double)t2 - t1 ) / 1e6, time_unit );
+  return 0;
+  }
+
+
+     // Blocks of a disk image, a quarter of them zero. The rest are copied
+     // from a pool of 64 random blocks, and half of those copies have one
+     // byte changed.
+void make_disk_image( std::string & data, const int size )
+  {
+  const int block_size = 4096, pool_blocks = 64;
+  unsigned seed = 3;
+  std::string pool;
+  while( (int)pool.size() < pool_blocks * block_size )
+    pool += random_byte( seed );
+  while( (int)data.size() < size )
+    {
+    const unsigned kind = next_random( seed ) % 8;
+    if( kind < 2 ) { data.append( block_size, 0 ); continue; }
+    const int pos = data.size();
+    data.append( pool, next_random( seed ) % pool_blocks * block_size,
+                 block_size );
+    if( kind & 1 ) data[pos+next_random( seed ) % block_size] ^= 1;
+    }
+  }
+
+
+int bench_match()
+  {
+  static const int settings[][2] =	// dictionary size, match length limit
+    { { 1 << 23, 273 }, { 1 << 23, 36 }, { 65535, 16 } };
+  std::string data;
+  make_disk_image( data, 24 << 20 );
+  printf( "%10s %6s %10s %8s  M%s\n", "dictionary", "match", "packed",
+          "ratio", time_unit );
+  for( int i = 0; i < 3; ++i )
+    {
+    std::string packed;
+    unsigned long long best = 0;
+    for( int j = 0; j < runs; ++j )
+      {
+      const unsigned long long t0 = now();
+      if( !compress( data, packed, settings[i][0], settings[i][1] ) )
+        { fputs( "lzbench: can't compress the data.\n", stderr ); return 1; }
+      const unsigned long long t = now() - t0;
+      if( j == 0 || t < best ) best = t;
+      }
+    printf( "%9dK %6d %10lu %7.1f:1  %8.1f\n", settings[i][0] >> 10,
+            settings[i][1], (unsigned long)packed.size(),
+            (double)data.size() / packed.size(), best / 1e6 );
+    }
+  return 0;
+  }
+
+} // end namespace
+
+
+int main( const int argc, const char * const argv[] )
+  {
+  int argind = 1;
+  for( ; argind + 1 < argc && argv[argind][0] == '-'; argind += 2 )
+    {
+    if( strcmp( argv[argind], "-r" ) == 0 ) runs = atoi( argv[argind+1] );
+    else if( strcmp( argv[argind], "-o" ) == 0 ) output_name = argv[argind+1];
+    else break;
+    }
+  if( argind >= argc || argv[argind][0] == '-' || runs < 0 )
+    { fputs( "Usage: lzbench [-r runs] [-o output] decode|write|far|match "
+             "[files]\n", stderr ); return 1; }
+  const std::string mode = argv[argind++];
+  if( runs == 0 ) runs = ( mode == "match" ) ? 3 : 10;
+  if( mode == "far" ) return bench_far();
+  if( mode == "match" ) return bench_match();
+
+  std::vector< Input > inputs;
+  make_inputs( inputs );
+  for( ; argind < argc; ++argind )
+    {
+    Input in;
+    in.name = argv[argind];
+    if( !read_file( argv[argind], in.data ) )
+      { fprintf( stderr, "lzbench: can't read '%s'.\n", argv[argind] );
+        return 1; }
+    inputs.push_back( in );
+    }
+  if( mode == "decode" ) return bench_decode( inputs );
+  if( mode == "write" ) return bench_write( inputs );
+  fprintf( stderr, "lzbench: unknown mode '%s'.\n", mode.c_str() );
+  return 1;
+  }
@@ -0,0 +1,373 @@
+/*  Libtest - Round-trip tests of the lzip library (lzlib.h)
+    Copyright (C) 2008, 2009, 2010, 2011 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    Compresses and decompresses a set of generated inputs with the buffer
+    and the streaming interfaces, on several threads at once, and checks
+    that the data comes back unchanged and that damaged input is reported.
+    Exit status is 0 if all the tests pass, 1 otherwise.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
+
+#include "lzlib.h"
+
+
+namespace {
+
+struct Encoder_options
+  {
+  int dictionary_size;
+  int match_len_limit;
+  long long member_size;
+  };
+
+const Encoder_options encoder_options[] =
+  {
+  { 1 << 16, 36, 1LL << 40 },		// one member
+  { 1 << 20, 273, 100000 },		// several members
+  { 65535, 16, 1LL << 40 },		// fast encoder
+  { 65535, 16, 70000 },
+  };
+const int num_options = sizeof encoder_options / sizeof encoder_options[0];
+
+std::vector< std::string > inputs;
+int failures = 0;
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+void fail( const char * const test, const int input, const int option,
+           const char * const msg )
+  {
+  pthread_mutex_lock( &mutex );
+  ++failures;
+  fprintf( stderr, "libtest: %s, input %d, options %d: %s\n",
+           test, input, option, msg );
+  pthread_mutex_unlock( &mutex );
+  }
+
+
+unsigned next_random( unsigned & seed )
+  { seed = seed * 1103515245U + 12345U; return seed >> 8; }
+
+
+     // Inputs of different sizes and redundancy, made from a fixed seed.
+void make_inputs()
+  {
+  static const char * const words[] =
+    { "the ", "lzip ", "member ", "window ", "of ", "data ", "range ",
+      "decoder\n", "and ", "match ", "literal ", "a " };
+  unsigned seed = 1;
+  std::string s;
+  inputs.push_back( s );			// empty
+  inputs.push_back( "x" );
+  for( int i = 0; i < 40000; ++i ) s += words[next_random( seed ) % 12];
+  inputs.push_back( s );			// text
+  s.clear();
+  for( int i = 0; i < 100000; ++i ) s += (char)next_random( seed );
+  inputs.push_back( s );			// random
+  s.clear();
+  for( int i = 0; i < 3000; ++i )		// runs, repeats and noise
+    {
+    const int len = next_random( seed ) % 200;
+    const unsigned kind = next_random( seed ) % 3;
+    if( kind == 0 ) s.append( len, (char)next_random( seed ) );
+    else if( kind == 1 && s.size() > 300 )
+      s.append( s, s.size() - 1 - next_random( seed ) % 300, len );
+    else for( int j = 0; j < len; ++j ) s += (char)next_random( seed );
+    }
+  inputs.push_back( s );			// mixed
+  inputs.push_back( std::string( 300000, '\0' ) );
+  }
+
+
+long long compress( LZ_Encoder * const encoder, const std::string & in,
+                    std::string & out )
+  {
+  const uint8_t * p;
+  const long long size =
+    LZ_compress_buffer( encoder, (const uint8_t *)in.data(), in.size(), &p );
+  if( size >= 0 ) out.assign( (const char *)p, size );
+  return size;
+  }
+
+
+     // Feeds 'in' to the decoder in pieces of 'in_chunk' bytes, after a
+     // first piece of 'first_chunk' bytes if not 0, and reads the output
+     // in pieces of 'out_chunk' bytes. Returns the status of the last
+     // call, which is LZ_done on success.
+int stream_decompress( LZ_Decoder * const decoder, const std::string & in,
+                       const int in_chunk, const int out_chunk,
+                       std::string & out, const int first_chunk = 0 )
+  {
+  uint8_t buf[16384];
+  unsigned pos = 0;
+  bool finished = false;
+  out.clear();
+  LZ_decompress_reset( decoder );
+  while( true )
+    {
+    const int chunk = ( pos == 0 && first_chunk > 0 ) ? first_chunk : in_chunk;
+    int insize = ( in.size() - pos < (unsigned)chunk ) ?
+                 in.size() - pos : chunk;
+    int outsize = out_chunk;
+    const int status =
+      LZ_decompress_stream( decoder, (const uint8_t *)in.data() + pos,
+                            &insize, buf, &outsize );
+    if( status < 0 ) return status;
+    pos += insize;
+    out.append( (const char *)buf, outsize );
+    if( status == LZ_done ) return status;
+    if( pos >= in.size() )
+      {
+      if( finished && insize == 0 && outsize == 0 ) return status;	// stuck
+      if( !finished ) { LZ_decompress_finish( decoder ); finished = true; }
+      }
+    }
+  }
+
+
+     // Same as 'stream_decompress', but for the encoder.
+int stream_compress( LZ_Encoder * const encoder, const std::string & in,
+                     const int in_chunk, const int out_chunk,
+                     std::string & out )
+  {
+  uint8_t buf[16384];
+  unsigned pos = 0;
+  bool finished = false;
+  out.clear();
+  LZ_compress_reset( encoder );
+  while( true )
+    {
+    int insize = ( in.size() - pos < (unsigned)in_chunk ) ?
+                 in.size() - pos : in_chunk;
+    int outsize = out_chunk;
+    const int status =
+      LZ_compress_stream( encoder, (const uint8_t *)in.data() + pos,
+                          &insize, buf, &outsize );
+    if( status < 0 ) return status;
+    pos += insize;
+    out.append( (const char *)buf, outsize );
+    if( status == LZ_done ) return status;
+    if( pos >= in.size() )
+      {
+      if( finished && insize == 0 && outsize == 0 ) return status;	// stuck
+      if( !finished ) { LZ_compress_finish( encoder ); finished = true; }
+      }
+    }
+  }
+
+
+bool same_data( LZ_Decoder * const decoder, const std::string & packed,
+                const std::string & data )
+  {
+  const uint8_t * p;
+  const long long size = LZ_decompress_buffer( decoder,
+    (const uint8_t *)packed.data(), packed.size(), &p );
+  return size == (long long)data.size() &&
+         ( size == 0 || memcmp( p, data.data(), size ) == 0 );
+  }
+
+
+void test_input( LZ_Encoder * const encoder, LZ_Decoder * const decoder,
+                 const int i, const int o )
+  {
+  const std::string & data = inputs[i];
+  std::string packed, out;
+  if( compress( encoder, data, packed ) < 0 )
+    { fail( "compress_buffer", i, o,
+            LZ_strerror( LZ_compress_errno( encoder ) ) ); return; }
+  if( !same_data( decoder, packed, data ) )
+    fail( "decompress_buffer", i, o,
+          LZ_strerror( LZ_decompress_errno( decoder ) ) );
+
+  if( stream_decompress( decoder, packed, 1 << 20, 1 << 14, out ) != LZ_done ||
+      out != data )
+    fail( "decompress_stream", i, o,
+          LZ_strerror( LZ_decompress_errno( decoder ) ) );
+
+  // Small pieces of input split the stream at every position around the
+  // member headers. Also split it right after each header.
+  static const int small_chunks[] = { 1, 2, 3, 6, 7, 13 };
+  for( int c = 0; c < 6; ++c )
+    if( stream_decompress( decoder, packed, small_chunks[c], 5, out ) != LZ_done ||
+        out != data )
+      fail( "decompress_stream in small pieces", i, o,
+            LZ_strerror( LZ_decompress_errno( decoder ) ) );
+  for( unsigned pos = packed.find( "LZIP" ); pos < packed.size();
+       pos = packed.find( "LZIP", pos + 1 ) )
+    if( stream_decompress( decoder, packed, 1 << 20, 1 << 14, out,
+                           pos + 6 ) != LZ_done || out != data )
+      fail( "decompress_stream split after a header", i, o,
+            LZ_strerror( LZ_decompress_errno( decoder ) ) );
+
+  static const int chunks[] = { 65536, 4096, 7, 1 };
+  for( int c = 0; c < 4; ++c )
+    {
+    if( chunks[c] < 100 && data.size() > 20000 ) break;	// too slow
+    if( stream_compress( encoder, data, chunks[c], chunks[3-c], out ) != LZ_done ||
+        !same_data( decoder, out, data ) )
+      fail( "compress_stream", i, o,
+            LZ_strerror( LZ_compress_errno( encoder ) ) );
+    }
+
+  // Trailing data is ignored, but a truncated member is an error; it is
+  // reported as a data error if only the trailer is incomplete.
+  const uint8_t * p;
+  const std::string garbage = packed + "garbage";
+  if( !same_data( decoder, garbage, data ) )
+    fail( "trailing data", i, o,
+          LZ_strerror( LZ_decompress_errno( decoder ) ) );
+  static const int cuts[] = { 1, 30 };	// in the trailer, in the data
+  for( int c = 0; c < 2; ++c )
+    {
+    const std::string truncated( packed, 0, packed.size() - cuts[c] );
+    const LZ_Errno expected = ( c == 0 ) ? LZ_data_error : LZ_unexpected_eof;
+    if( LZ_decompress_buffer( decoder, (const uint8_t *)truncated.data(),
+                              truncated.size(), &p ) >= 0 ||
+        LZ_decompress_errno( decoder ) != expected )
+      fail( "truncated member", i, o,
+            LZ_strerror( LZ_decompress_errno( decoder ) ) );
+    if( stream_decompress( decoder, truncated, 1 << 20, 1 << 14, out ) >= 0 ||
+        LZ_decompress_errno( decoder ) != expected )
+      fail( "truncated stream", i, o,
+            LZ_strerror( LZ_decompress_errno( decoder ) ) );
+    }
+
+  // A data size in the last trailer that is negative (top byte set), one
+  // too large, or zero, is a data error, not a crash or a huge allocation.
+  // A new decoder has no output buffer yet.
+  for( int c = 0; c < 3; ++c )
+    {
+    std::string corrupt( packed );
+    const unsigned ds = corrupt.size() - 16;	// data size, little endian
+    if( c == 0 ) corrupt[ds+7] |= 0x80;
+    else if( c == 1 ) { unsigned k = 0;		// add 1 with carry
+                        while( k < 8 && ++corrupt[ds+k] == 0 ) ++k; }
+    else { if( data.empty() ) continue;
+           for( int k = 0; k < 8; ++k ) corrupt[ds+k] = 0; }
+    LZ_Decoder * const new_decoder = LZ_decompress_open();
+    if( LZ_decompress_buffer( new_decoder, (const uint8_t *)corrupt.data(),
+                              corrupt.size(), &p ) >= 0 ||
+        LZ_decompress_errno( new_decoder ) != LZ_data_error )
+      fail( "corrupt trailer", i, o,
+            LZ_strerror( LZ_decompress_errno( new_decoder ) ) );
+    LZ_decompress_close( new_decoder );
+    if( stream_decompress( decoder, corrupt, 1 << 20, 1 << 14, out ) >= 0 ||
+        LZ_decompress_errno( decoder ) != LZ_data_error )
+      fail( "corrupt trailer in stream", i, o,
+            LZ_strerror( LZ_decompress_errno( decoder ) ) );
+    }
+  }
+
+
+     // Runs the tests of one set of encoder options. Each set runs on
+     // its own thread, so that the library is used concurrently.
+extern "C" void * run_tests( void * const arg )
+  {
+  const int o = *(const int *)arg;
+  const Encoder_options & eo = encoder_options[o];
+  LZ_Encoder * const encoder =
+    LZ_compress_open( eo.dictionary_size, eo.match_len_limit, eo.member_size );
+  LZ_Decoder * const decoder = LZ_decompress_open();
+  if( !encoder || !decoder || LZ_compress_errno( encoder ) != LZ_ok )
+    { fail( "open", 0, o, "can't create the encoder or decoder" );
+      LZ_compress_close( encoder ); LZ_decompress_close( decoder );
+      return 0; }
+  const uint8_t * p;		// no input at all is valid, and empty
+  if( LZ_compress_buffer( encoder, 0, 0, &p ) <= 0 )
+    fail( "compress_buffer", -1, o,
+          LZ_strerror( LZ_compress_errno( encoder ) ) );
+  else if( LZ_decompress_buffer( decoder, 0, 0, &p ) >= 0 ||
+           LZ_decompress_errno( decoder ) != LZ_unexpected_eof )
+    fail( "decompress_buffer", -1, o, "empty input not reported" );
+  for( unsigned i = 0; i < inputs.size(); ++i )
+    test_input( encoder, decoder, i, o );
+  LZ_compress_close( encoder );
+  LZ_decompress_close( decoder );
+  return 0;
+  }
+
+     // A trailer may claim up to 8000 times the size of its member. If
+     // that is not plausible for the whole buffer, the output is not
+     // allocated in advance, so a claim larger than the memory limit is a
+     // data error, not a memory error. Run alone; it changes the limit.
+void test_claimed_size()
+  {
+  const long long claimed = 0x7FFFFFFF;
+  struct rlimit old_limit;
+  if( getrlimit( RLIMIT_AS, &old_limit ) != 0 ||
+      ( old_limit.rlim_cur != RLIM_INFINITY &&
+        old_limit.rlim_cur < (rlim_t)claimed ) ) return;
+  unsigned seed = 3;
+  std::string data, packed;
+  for( int i = 0; i < 300000; ++i ) data += (char)next_random( seed );
+  LZ_Encoder * const encoder = LZ_compress_open( 1 << 16, 36, 1LL << 40 );
+  if( compress( encoder, data, packed ) < 0 )
+    fail( "claimed size", -1, 0, LZ_strerror( LZ_compress_errno( encoder ) ) );
+  LZ_compress_close( encoder );
+  if( packed.size() * 8000 < claimed ) return;
+  const unsigned ds = packed.size() - 16;	// data size, little endian
+  for( int k = 0; k < 8; ++k ) packed[ds+k] = ( claimed >> ( 8 * k ) ) & 0xFF;
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = claimed / 2;
+  if( setrlimit( RLIMIT_AS, &limit ) != 0 ) return;
+  LZ_Decoder * const decoder = LZ_decompress_open();
+  const uint8_t * p;
+  if( LZ_decompress_buffer( decoder, (const uint8_t *)packed.data(),
+                            packed.size(), &p ) >= 0 ||
+      LZ_decompress_errno( decoder ) != LZ_data_error )
+    fail( "claimed size", -1, 0,
+          LZ_strerror( LZ_decompress_errno( decoder ) ) );
+  LZ_decompress_close( decoder );
+  setrlimit( RLIMIT_AS, &old_limit );
+  }
+
+} // end namespace
+
+
+int main()
+  {
+  LZ_Encoder * const encoder = LZ_compress_open( 1 << 16, 36, 1LL << 40 );
+  const bool decoder_only =
+    ( LZ_compress_errno( encoder ) == LZ_library_error );
+  LZ_compress_close( encoder );
+  if( decoder_only )
+    { fprintf( stderr, "libtest: library built without the encoder; "
+                       "nothing tested.\n" ); return 0; }
+
+  make_inputs();
+  pthread_t threads[num_options];
+  int options[num_options];
+  for( int o = 0; o < num_options; ++o )
+    {
+    options[o] = o;
+    if( pthread_create( &threads[o], 0, run_tests, &options[o] ) != 0 )
+      { fprintf( stderr, "libtest: can't create threads.\n" ); return 1; }
+    }
+  for( int o = 0; o < num_options; ++o ) pthread_join( threads[o], 0 );
+  test_claimed_size();
+  if( failures ) { fprintf( stderr, "libtest: %d failures.\n", failures );
+                   return 1; }
+  printf( "libtest: all tests passed.\n" );
+  return 0;
+  }
@@ -0,0 +1,146 @@
+/*  Matchtest - Tests of the match length comparison of the encoder
+    Copyright (C) 2008, 2009, 2010, 2011 Antonio Diaz Diaz.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+    Compares the result of 'match_len' (encoder.h) with that of a byte
+    loop, for every length limit up to a little over the longest match,
+    every position of the first difference, and every alignment of the
+    two strings. The strings end just before a page that can't be read,
+    so that reading past the limit faults. Overlapping strings, as found
+    by the matchfinders for short distances, are tested too.
+    Exit status is 0 if all the tests pass, 1 otherwise.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "lzip.h"
+#include "encoder.h"
+
+
+namespace {
+
+const int max_limit = max_match_len + 16;
+int failures = 0;
+
+
+unsigned next_random( unsigned & seed )
+  { seed = seed * 1103515245U + 12345U; return seed >> 8; }
+
+
+int byte_match_len( const uint8_t * const p1, const uint8_t * const p2,
+                    const int limit )
+  {
+  int len = 0;
+  while( len < limit && p1[len] == p2[len] ) ++len;
+  return len;
+  }
+
+
+void check( const uint8_t * const p1, const uint8_t * const p2,
+            const int limit, const char * const test )
+  {
+  const int expected = byte_match_len( p1, p2, limit );
+  const int len = match_len( p1, p2, limit );
+  if( len != expected && ++failures <= 10 )
+    fprintf( stderr, "matchtest: %s, limit %d, offset %d: "
+                     "got %d, expected %d\n", test, limit,
+             (int)( (uintptr_t)p1 & 7 ), len, expected );
+  }
+
+
+     // Returns the end of a writable page followed by one that can't be
+     // accessed, or 0.
+uint8_t * guarded_page_end( const long page_size )
+  {
+  void * const p = mmap( 0, 2 * page_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( p == MAP_FAILED ) return 0;
+  uint8_t * const end = (uint8_t *)p + page_size;
+  if( mprotect( end, page_size, PROT_NONE ) != 0 ) return 0;
+  return end;
+  }
+
+
+     // Both strings end at a guard page, or 'shift' bytes before it, and
+     // differ first at 'diff', if it is less than 'limit'.
+void test_guarded( uint8_t * const end1, uint8_t * const end2 )
+  {
+  unsigned seed = 1;
+  for( int limit = 0; limit <= max_limit; ++limit )
+    for( int shift = 0; shift < 8; ++shift )
+      {
+      uint8_t * const p1 = end1 - limit;
+      uint8_t * const p2 = end2 - limit - shift;
+      for( int i = 0; i < limit; ++i ) p1[i] = p2[i] = next_random( seed );
+      for( int diff = 0; diff <= limit; ++diff )
+        {
+        if( diff < limit ) p2[diff] ^= 1 + next_random( seed ) % 255;
+        check( p1, p2, limit, "at the end of a buffer" );
+        check( p2, p1, limit, "at the end of a buffer" );
+        if( diff < limit ) p2[diff] = p1[diff];
+        }
+      }
+  }
+
+
+     // 'p1' is 'distance' bytes after 'p2' in data that repeats with a
+     // period of 'period' bytes, as in runs and in short periodic data.
+void test_overlapping( uint8_t * const end )
+  {
+  const int size = 2 * max_limit + 8;
+  uint8_t * const buf = end - size;
+  unsigned seed = 2;
+  for( int period = 1; period <= 20; ++period )
+    {
+    for( int i = 0; i < size; ++i )
+      buf[i] = ( i < period ) ? next_random( seed ) : buf[i-period];
+    for( int distance = 1; distance <= 24; ++distance )
+      for( int start = 0; start < 8; ++start )
+        for( int limit = 0; limit <= max_limit; ++limit )
+          {
+          uint8_t * const p1 = end - limit - start;
+          check( p1, p1 - distance, limit, "overlapping" );
+          }
+    buf[size-1-period] ^= 0x80;		// breaks the period near the end
+    for( int distance = 1; distance <= 24; ++distance )
+      for( int limit = 0; limit <= max_limit; ++limit )
+        check( end - limit, end - limit - distance, limit, "overlapping" );
+    }
+  }
+
+} // end namespace
+
+
+int main()
+  {
+  const long page_size = sysconf( _SC_PAGESIZE );
+  uint8_t * const end1 = ( page_size > 0 ) ? guarded_page_end( page_size ) : 0;
+  uint8_t * const end2 = ( page_size > 0 ) ? guarded_page_end( page_size ) : 0;
+  if( !end1 || !end2 || page_size < 4 * max_limit )
+    { fprintf( stderr, "matchtest: can't map the test buffers.\n" );
+      return 1; }
+  test_guarded( end1, end2 );
+  test_overlapping( end1 );
+  if( failures ) { fprintf( stderr, "matchtest: %d failures.\n", failures );
+                   return 1; }
+  printf( "matchtest: all tests passed.\n" );
+  return 0;
+  }